@@ -6,58 +6,312 @@
 #ifndef _DSACRE_UNART_H
 #define _DSACRE_UNART_H
 
+#include <linux/average.h>
+#include <linux/container_of.h>
+#include <linux/cpumask.h>
 #include <linux/hrtimer.h>
+#include <linux/irq_work.h>
+#include <linux/jump_label.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
 #include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/platform_device.h>
+#include <linux/pm_qos.h>
 #include <linux/spinlock.h>
 #include <linux/tty_port.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #define UNART_DEFAULT_RX_SKEW 30
+#define UNART_DEFAULT_RX_MODE "sample"
+#define UNART_DEFAULT_RX_THRESHOLD 1
+#define UNART_DEFAULT_RX_IDLE_TIMEOUT 4
+#define UNART_DEFAULT_RX_STREAM_BITS 0
+#define UNART_DEFAULT_TX_LOW_WATERMARK 256
+#define UNART_DEFAULT_TX_SPIN_BUDGET 0
+#define UNART_DEFAULT_RX_FIFO_SIZE 32
 
-#define UNART_RX_FIFO_SIZE 32
+#define UNART_RX_OVERSAMPLING 4
+#define UNART_RX_STREAM_BITS_MAX 100
+#define UNART_RX_FIFO_SIZE_MAX 65536
+#define UNART_RX_PUSH_SIZE 64
+#define UNART_RX_EDGE_FIFO_SIZE 32
 #define UNART_TX_FIFO_SIZE 1024
+#define UNART_TX_SPIN_BUDGET_MAX 200
 
 #define UNART_MAX_TTY_DEVICES 32
 
+#define UNART_AUTOBAUD_EDGES 40
+
+// Maximum size of a Modbus RTU frame (ADU).
+#define UNART_MODBUS_FRAME_SIZE 256
+
+#define UNART_HISTOGRAM_BUCKETS 32
+
 
 struct unart_module_params {
 	char *gpiochip;
 	int rx_gpio;
 	int tx_gpio;
 	unsigned int rx_skew;
+	bool rx_skew_auto;
+	unsigned int rx_vote_spacing;
+	bool autobaud;
+	char *rx_mode;
+	unsigned int rx_fifo_size;
+	unsigned int rx_threshold;
+	int rx_match_char;
+	unsigned int rx_idle_timeout;
+	unsigned int rx_stream_bits;
+	bool rx_mask_irq;
+	bool modbus_rtu;
 	bool rx_debug;
+	unsigned int tx_low_watermark;
+	unsigned int tx_spin_budget;
+	bool tx_shared_clock;
+	int poll_cpu;
+	int cpu_latency;
+	bool cpu_spread;
+	int worker_priority;
+	int worker_cpu;
+	bool histograms;
+	bool cpu_accounting;
 };
 
 extern struct unart_module_params unart_params;
 
+extern struct kthread_worker *unart_worker;
+
+DECLARE_STATIC_KEY_FALSE(unart_histograms_enabled);
+DECLARE_STATIC_KEY_FALSE(unart_cpu_accounting_enabled);
+
+
+struct dentry;
 
 struct unart;
+struct unart_tick_group;
+struct unart_bank;
+struct unart_poller;
+
+/*
+ * Log2 histogram of time deltas in nanoseconds. Bucket 0 counts deltas <= 0,
+ * bucket n counts deltas in [2^(n-1), 2^n).
+ */
+struct unart_histogram {
+	unsigned long buckets[UNART_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * CPU time spent in one kind of IRQ or timer callback.
+ */
+struct unart_cpu_time {
+	u64 total_ns;
+	u64 max_ns;
+	unsigned long count;
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Bit clock with a fractional period. Deadlines are advanced from the ideal
+ * time of the previous one, not from when a callback actually ran, so neither
+ * late callbacks nor rounding errors accumulate.
+ */
+struct unart_clock {
+	// Bit period, in units of 2^-32 ns.
+	u64 period;
+	// Current deadline, and its fractional part.
+	ktime_t time;
+	u32 frac;
+};
+
+/*
+ * Moving average of sampling latency in nanoseconds.
+ */
+DECLARE_EWMA(unart_latency, 4, 16)
+
+struct unart_rx_stats {
+	unsigned long bytes;
+	unsigned long frame_errors;
+	unsigned long false_starts;
+	unsigned long overruns;
+	unsigned long breaks;
+	unsigned long vote_corrections;
+	unsigned long modbus_t15_violations;
+	unsigned long irqs;
+	unsigned long timer_callbacks;
+
+	struct unart_histogram timer_lateness;
+	struct unart_histogram irq_latency;
+
+	struct unart_cpu_time irq_time;
+	struct unart_cpu_time timer_time;
+};
+
+struct unart_tx_stats {
+	unsigned long bytes;
+	unsigned long timer_callbacks;
+
+	struct unart_histogram timer_lateness;
+
+	struct unart_cpu_time timer_time;
+};
+
+/*
+ * Deferred work, run by unart_worker if there is one, or by the system
+ * workqueue otherwise. See unart_util.h.
+ */
+struct unart_work {
+	struct work_struct work;
+	struct kthread_work kwork;
+	void (*func)(struct unart_work *work);
+};
+
+enum unart_rx_error {
+	// Start bit was high when sampled.
+	UNART_RX_FALSE_START,
+	// Stop bit was low.
+	UNART_RX_FRAME_ERROR,
+	// Line was low for the whole frame.
+	UNART_RX_BREAK,
+};
+
+/*
+ * Entry in the RX FIFO, with one of the TTY_* flags.
+ */
+struct unart_rx_char {
+	u8 ch;
+	u8 flag;
+};
+
+enum unart_rx_mode {
+	// Sample each bit with the hrtimer, starting from the falling edge.
+	UNART_RX_MODE_SAMPLE,
+	// Timestamp both edges and reconstruct the frame after the stop bit.
+	UNART_RX_MODE_EDGE,
+	// Sample all lines on the same GPIO chip from one oversampling timer.
+	UNART_RX_MODE_BANK,
+};
 
 struct unart_rx {
 	struct gpio_desc *gpio;
 	struct hrtimer timer;
 	int irq;
 
+	enum unart_rx_mode mode;
+
+	// Whether the IRQ is masked while a frame is sampled, so data bits
+	// don't cause further IRQs.
+	bool mask_irq;
+	bool irq_masked;
+	bool irq_replay;
+
+	unsigned int baudrate;
 	unsigned int skew_percent;
 	ktime_t period;
 	ktime_t skew;
 
-	struct kfifo fifo;
-	struct work_struct push_work;
-	void (*push_callback)(struct unart *unart, const u8 *buf, size_t count);
+	// Adjust the skew to the measured sampling latency, instead of using
+	// skew_percent.
+	bool skew_auto;
+	struct ewma_unart_latency latency;
+
+	// Spacing in nanoseconds of three samples per bit, which are combined
+	// by majority vote, or 0 to take only one. The configured spacing is
+	// limited to a tenth of the bit period.
+	u32 vote_spacing_config;
+	u32 vote_spacing;
+	struct unart_clock clock;
+
+	DECLARE_KFIFO_PTR(fifo, struct unart_rx_char);
+	struct unart_work push_work;
+	// Called for each chunk of data, with done set on the last one.
+	void (*push_callback)(struct unart *unart, const u8 *buf, const u8 *flags,
+			      size_t count, bool overrun, bool done);
+
+	// Set when a byte is lost because the FIFO is full, until that is
+	// reported along with the next push.
+	bool overrun;
+
+	// Set after a break has been reported, until the line is seen to go
+	// high again, so a line held low only results in a single break.
+	bool in_break;
+
+	// Push to the TTY buffer once the FIFO holds this many bytes, when
+	// match_char (if not -1) is received, or after the line has been idle
+	// for idle_chars character times. threshold_config is 0 if no
+	// threshold was configured, in which case it depends on match_char.
+	unsigned int threshold_config;
+	unsigned int threshold;
+	int match_char;
+	unsigned int idle_chars;
+	ktime_t idle_timeout;
+	bool flush_pending;
 
 	int bit_index;
 	u8 payload;
 
+	// Number of bit times to keep sampling for another start bit after a
+	// valid stop bit, at UNART_RX_OVERSAMPLING times the baud rate.
+	unsigned int stream_bits;
+	unsigned int hunt_ticks;
+	ktime_t hunt_tick;
+
+	// Bank state, in units of bank ticks.
+	struct unart_bank *bank;
+	struct list_head bank_node;
+	unsigned int bank_ticks;
+	unsigned int idle_ticks;
+	unsigned int bank_idle_ticks;
+
+	// Edge decoder state. The ring is only written by the IRQ handler and
+	// only read by the timer callback.
+	DECLARE_KFIFO(edges, ktime_t, UNART_RX_EDGE_FIFO_SIZE);
+	ktime_t frame_start;
+	int level;
+	bool decoding;
+
+	// Polling thread state. The line is watched for the falling edge of
+	// the start bit, then sampled whenever the clock is due.
+	bool poll_sampling;
+	int poll_level;
+	ktime_t poll_flush_time;
+
+	// Modbus RTU framing. Data is only pushed once a frame has been
+	// followed by t3.5 of silence, which is the idle timeout in this mode.
+	// The lengths of complete frames still in the FIFO are kept in frames.
+	bool modbus;
+	DECLARE_KFIFO_PTR(frames, unsigned int);
+	unsigned int frame_len;
+	ktime_t modbus_t15;
+	ktime_t modbus_last_start;
+
+	// CPU for the IRQ and timer, or -1. The IRQ's original affinity is
+	// restored for -1.
+	int cpu;
+	struct cpumask irq_affinity;
+
+	// Baud rate detection, each time the port is opened. While active, the
+	// IRQ handlers only collect edge intervals, and no data is received.
+	bool autobaud;
+	bool autobaud_active;
+	unsigned int autobaud_edges;
+	ktime_t autobaud_last;
+	ktime_t autobaud_min;
+	unsigned int autobaud_rate;
+	struct work_struct autobaud_work;
+	void (*autobaud_callback)(struct unart *unart, unsigned int baudrate);
+
 	int debug_toggle;
 
+	struct unart_rx_stats stats;
+
 	raw_spinlock_t lock;
 };
 
 struct unart_tx {
+	struct device *dev;
 	struct gpio_desc *gpio;
 	struct hrtimer timer;
 
@@ -65,11 +319,44 @@ struct unart_tx {
 
 	struct kfifo fifo;
 	wait_queue_head_t wait_queue;
-	struct work_struct wakeup_work;
+	struct unart_work wakeup_work;
 	void (*wakeup_callback)(struct unart *unart);
+	unsigned int low_watermark;
 
+	// Current frame, start and stop bits included. The timer only fires
+	// when the line level actually changes. The clock is at the start of
+	// the frame.
+	u16 frame;
 	int bit_index;
-	u8 payload;
+	struct unart_clock clock;
+
+	// CPU for the timer, or -1. Starting the timer from another CPU is
+	// deferred to an irq_work on that CPU.
+	int cpu;
+	struct irq_work start_work;
+	bool start_pending;
+
+	// Maximum time to busy-wait in the timer callback for further level
+	// transitions, instead of restarting the timer.
+	ktime_t spin_budget;
+
+	// Shared bit clock for all instances with the same baud rate, used
+	// instead of the timer if enabled. tick_lock keeps writers from using
+	// a group that's being left, and from starting the timer while
+	// switching groups.
+	bool shared_clock;
+	struct unart_tick_group *tick_group;
+	struct list_head tick_node;
+	bool tick_switching;
+	raw_spinlock_t tick_lock;
+
+	// Driven by a polling thread instead of the timer or tick group.
+	bool polled;
+
+	// Whether a frame is being sent by the tick group or polling thread.
+	bool tick_active;
+
+	struct unart_tx_stats stats;
 
 	raw_spinlock_t lock;
 };
@@ -78,22 +365,73 @@ struct unart {
 	struct unart_rx rx;
 	struct unart_tx tx;
 
+	// CPU of the polling thread that drives RX and TX instead of IRQs and
+	// timers, or -1.
+	int poll_cpu;
+	struct unart_poller *poller;
+	struct list_head poll_node;
+
 	unsigned int tty_index;
 	struct device *tty_dev;
 	struct tty_port tty_port;
+
+	// CPU wakeup latency in microseconds to request while the port is
+	// open, or -1 to derive it from the baud rate.
+	int cpu_latency;
+	struct pm_qos_request pm_qos;
+
+	struct dentry *debugfs_dir;
 };
 
+/*
+ * Port number for tracing.
+ */
+static inline unsigned int unart_rx_port(struct unart_rx *rx)
+{
+	return container_of(rx, struct unart, rx)->tty_index;
+}
+
+static inline unsigned int unart_tx_port(struct unart_tx *tx)
+{
+	return container_of(tx, struct unart, tx)->tty_index;
+}
+
 
 int	unart_rx_setup(struct platform_device *pdev, struct unart_rx *rx);
 void	unart_rx_set_baud_rate(struct unart_rx *rx, unsigned int baudrate);
 int	unart_rx_activate(struct unart_rx *rx);
 void	unart_rx_shutdown(struct unart_rx *rx);
+void	unart_rx_bank_sample(struct unart_rx *rx, int bit, ktime_t lateness);
+void	unart_rx_bank_reset(struct unart_rx *rx);
+void	unart_rx_poll(struct unart_rx *rx, ktime_t now);
+void	unart_rx_poll_reset(struct unart_rx *rx);
+int	unart_rx_set_cpu(struct unart_rx *rx, int cpu);
+void	unart_rx_set_skew_auto(struct unart_rx *rx, bool skew_auto);
+int	unart_rx_set_autobaud(struct unart_rx *rx, bool autobaud);
+int	unart_rx_set_match_char(struct unart_rx *rx, int match_char);
+
+int	unart_bank_attach(struct unart_rx *rx);
+void	unart_bank_detach(struct unart_rx *rx);
 
 int	unart_tx_setup(struct platform_device *pdev, struct unart_tx *tx);
 void	unart_tx_set_baud_rate(struct unart_tx *tx, unsigned int baudrate);
 ssize_t	unart_tx_write(struct unart_tx *tx, const u8 *buf, size_t count);
 size_t	unart_tx_write_room(struct unart_tx *tx);
+void	unart_tx_set_low_watermark(struct unart_tx *tx, unsigned int low_watermark);
 void	unart_tx_wait_until_sent(struct unart_tx *tx, int timeout);
+bool	unart_tx_tick_start(struct unart_tx *tx);
+bool	unart_tx_tick(struct unart_tx *tx, int *level);
+void	unart_tx_poll(struct unart_tx *tx, ktime_t now);
+void	unart_tx_set_polled(struct unart_tx *tx, bool polled);
+void	unart_tx_set_cpu(struct unart_tx *tx, int cpu);
+
+int	unart_tick_attach(struct unart_tx *tx);
+void	unart_tick_detach(struct unart_tx *tx);
+void	unart_tick_start(struct unart_tx *tx);
+
+int	unart_poll_setup(struct platform_device *pdev, struct unart *unart);
+int	unart_poll_attach(struct unart *unart);
+void	unart_poll_detach(struct unart *unart);
 
 
 int	unart_tty_device_setup(struct platform_device *pdev, struct unart *unart);
@@ -102,4 +440,10 @@ int	unart_tty_register_driver(void);
 void	unart_tty_unregister_driver(void);
 
 
+int	unart_debugfs_device_setup(struct platform_device *pdev, struct unart *unart);
+
+void	unart_debugfs_init(void);
+void	unart_debugfs_exit(void);
+
+
 #endif /* _DSACRE_UNART_H */
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * unart - definitely not a real UART
+ * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
+ */
+#include "unart.h"
+#include "unart_trace.h"
+#include "unart_util.h"
+
+#include <linux/bitmap.h>
+#include <linux/container_of.h>
+#include <linux/errno.h>
+#include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/*
+ * A bank samples the RX lines of all active instances on the same GPIO
+ * controller and with the same baud rate from a single hrtimer, at
+ * UNART_RX_OVERSAMPLING times the baud rate. Each instance then decodes its
+ * own frames from the shared samples.
+ */
+struct unart_bank {
+	struct list_head node;
+	const void *controller;
+	ktime_t period;
+
+	struct hrtimer timer;
+	struct unart_clock clock;
+	ktime_t tick;
+
+	struct list_head members;
+	unsigned int member_count;
+
+	// Scratch space for gpiod_get_raw_array_value().
+	struct gpio_desc *descs[UNART_MAX_TTY_DEVICES];
+	DECLARE_BITMAP(values, UNART_MAX_TTY_DEVICES);
+
+	raw_spinlock_t lock;
+};
+
+static LIST_HEAD(banks);
+static DEFINE_MUTEX(banks_mutex);
+
+
+static enum hrtimer_restart unart_bank_timer_callback(struct hrtimer *timer)
+{
+	struct unart_bank *bank = container_of(timer, struct unart_bank, timer);
+	struct unart_rx *rx;
+	unsigned int count = 0;
+	ktime_t lateness = 0;
+
+	raw_spin_lock_irqsave_scoped(&bank->lock);
+
+	if (trace_unart_rx_bit_enabled())
+		lateness = ktime_get() - hrtimer_get_expires(timer);
+
+	list_for_each_entry(rx, &bank->members, bank_node)
+		bank->descs[count++] = rx->gpio;
+
+	if (gpiod_get_raw_array_value(count, bank->descs, NULL, bank->values) == 0) {
+		count = 0;
+		list_for_each_entry(rx, &bank->members, bank_node)
+			unart_rx_bank_sample(rx, test_bit(count++, bank->values), lateness);
+	}
+
+	hrtimer_set_expires(timer, unart_clock_advance(&bank->clock,
+				bank->clock.period / UNART_RX_OVERSAMPLING));
+	return HRTIMER_RESTART;
+}
+
+
+/**
+ * Add an RX instance to the bank for its GPIO controller and current baud
+ * rate, creating the bank if necessary.
+ */
+int unart_bank_attach(struct unart_rx *rx)
+{
+	const void *controller = unart_gpiod_controller(rx->gpio);
+	struct unart_bank *bank;
+	unsigned long flags;
+
+	unart_rx_bank_reset(rx);
+
+	mutex_lock(&banks_mutex);
+
+	list_for_each_entry(bank, &banks, node) {
+		if (bank->controller == controller && bank->period == rx->period)
+			goto found;
+	}
+
+	bank = kzalloc(sizeof(*bank), GFP_KERNEL);
+	if (!bank) {
+		mutex_unlock(&banks_mutex);
+		return -ENOMEM;
+	}
+
+	bank->controller = controller;
+	bank->period = rx->period;
+	bank->tick = rx->period / UNART_RX_OVERSAMPLING;
+	bank->clock.period = rx->clock.period;
+	INIT_LIST_HEAD(&bank->members);
+	raw_spin_lock_init(&bank->lock);
+	hrtimer_setup(&bank->timer, &unart_bank_timer_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	list_add(&bank->node, &banks);
+
+found:
+	raw_spin_lock_irqsave(&bank->lock, flags);
+	list_add_tail(&rx->bank_node, &bank->members);
+	++bank->member_count;
+	raw_spin_unlock_irqrestore(&bank->lock, flags);
+
+	rx->bank = bank;
+
+	// Sampling runs for as long as there are members.
+	if (bank->member_count == 1) {
+		unart_clock_reset(&bank->clock, ktime_get() + bank->tick);
+		hrtimer_start(&bank->timer, bank->clock.time, HRTIMER_MODE_ABS_HARD);
+	}
+
+	mutex_unlock(&banks_mutex);
+	return 0;
+}
+
+/**
+ * Remove an RX instance from its bank. The bank is destroyed once its last
+ * member is gone.
+ */
+void unart_bank_detach(struct unart_rx *rx)
+{
+	struct unart_bank *bank = rx->bank;
+	unsigned long flags;
+
+	if (!bank)
+		return;
+
+	mutex_lock(&banks_mutex);
+
+	raw_spin_lock_irqsave(&bank->lock, flags);
+	list_del(&rx->bank_node);
+	--bank->member_count;
+	raw_spin_unlock_irqrestore(&bank->lock, flags);
+
+	rx->bank = NULL;
+
+	if (bank->member_count == 0) {
+		hrtimer_cancel(&bank->timer);
+		list_del(&bank->node);
+		kfree(bank);
+	}
+
+	mutex_unlock(&banks_mutex);
+}
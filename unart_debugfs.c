@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * unart - definitely not a real UART
+ * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
+ */
+#include "unart.h"
+
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/math64.h>
+#include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/u64_stats_sync.h>
+
+
+static struct dentry *unart_debugfs_root;
+
+
+static int unart_debugfs_stats_show(struct seq_file *s, void *unused)
+{
+	struct unart *unart = s->private;
+	const struct unart_rx_stats *rx = &unart->rx.stats;
+	const struct unart_tx_stats *tx = &unart->tx.stats;
+
+	seq_printf(s, "rx_bytes: %lu\n", READ_ONCE(rx->bytes));
+	seq_printf(s, "rx_frame_errors: %lu\n", READ_ONCE(rx->frame_errors));
+	seq_printf(s, "rx_false_starts: %lu\n", READ_ONCE(rx->false_starts));
+	seq_printf(s, "rx_overruns: %lu\n", READ_ONCE(rx->overruns));
+	seq_printf(s, "rx_breaks: %lu\n", READ_ONCE(rx->breaks));
+	seq_printf(s, "rx_vote_corrections: %lu\n", READ_ONCE(rx->vote_corrections));
+	seq_printf(s, "rx_modbus_t15_violations: %lu\n", READ_ONCE(rx->modbus_t15_violations));
+	seq_printf(s, "rx_irqs: %lu\n", READ_ONCE(rx->irqs));
+	seq_printf(s, "rx_timer_callbacks: %lu\n", READ_ONCE(rx->timer_callbacks));
+	seq_printf(s, "tx_bytes: %lu\n", READ_ONCE(tx->bytes));
+	seq_printf(s, "tx_timer_callbacks: %lu\n", READ_ONCE(tx->timer_callbacks));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(unart_debugfs_stats);
+
+static int unart_debugfs_histogram_show(struct seq_file *s, void *unused)
+{
+	const struct unart_histogram *hist = s->private;
+
+	seq_puts(s, "# ns count\n");
+
+	for (unsigned int i = 0; i < UNART_HISTOGRAM_BUCKETS; ++i) {
+		unsigned long count = READ_ONCE(hist->buckets[i]);
+		if (!count)
+			continue;
+
+		if (i == 0)
+			seq_printf(s, "0 %lu\n", count);
+		else
+			seq_printf(s, "%llu-%llu %lu\n",
+				   1ull << (i - 1), (1ull << i) - 1, count);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(unart_debugfs_histogram);
+
+static void unart_debugfs_print_cpu_time(struct seq_file *s, const char *name,
+					 const struct unart_cpu_time *time,
+					 unsigned long bytes)
+{
+	u64 total_ns, max_ns;
+	unsigned long count;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&time->syncp);
+		total_ns = time->total_ns;
+		max_ns = time->max_ns;
+		count = time->count;
+	} while (u64_stats_fetch_retry(&time->syncp, start));
+
+	seq_printf(s, "%s: count=%lu total_ns=%llu max_ns=%llu per_byte_ns=%llu\n",
+		   name, count, total_ns, max_ns,
+		   bytes ? div64_u64(total_ns, bytes) : 0);
+}
+
+static int unart_debugfs_cpu_time_show(struct seq_file *s, void *unused)
+{
+	struct unart *unart = s->private;
+	const struct unart_rx_stats *rx = &unart->rx.stats;
+	const struct unart_tx_stats *tx = &unart->tx.stats;
+	unsigned long rx_bytes = READ_ONCE(rx->bytes);
+	unsigned long tx_bytes = READ_ONCE(tx->bytes);
+
+	unart_debugfs_print_cpu_time(s, "rx_irq", &rx->irq_time, rx_bytes);
+	unart_debugfs_print_cpu_time(s, "rx_timer", &rx->timer_time, rx_bytes);
+	unart_debugfs_print_cpu_time(s, "tx_timer", &tx->timer_time, tx_bytes);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(unart_debugfs_cpu_time);
+
+
+static void unart_debugfs_device_cleanup(void *_unart)
+{
+	struct unart *unart = _unart;
+
+	debugfs_remove_recursive(unart->debugfs_dir);
+}
+
+/**
+ * Create the debugfs directory for one instance, named after the platform
+ * device.
+ */
+int unart_debugfs_device_setup(struct platform_device *pdev, struct unart *unart)
+{
+	// Like everywhere else, debugfs errors are not fatal.
+	unart->debugfs_dir = debugfs_create_dir(dev_name(&pdev->dev), unart_debugfs_root);
+
+	debugfs_create_file("stats", 0444, unart->debugfs_dir, unart,
+			    &unart_debugfs_stats_fops);
+
+	// Only filled in if the histograms module parameter is enabled.
+	debugfs_create_file("rx_timer_lateness", 0444, unart->debugfs_dir,
+			    &unart->rx.stats.timer_lateness,
+			    &unart_debugfs_histogram_fops);
+	debugfs_create_file("rx_irq_latency", 0444, unart->debugfs_dir,
+			    &unart->rx.stats.irq_latency,
+			    &unart_debugfs_histogram_fops);
+	debugfs_create_file("tx_timer_lateness", 0444, unart->debugfs_dir,
+			    &unart->tx.stats.timer_lateness,
+			    &unart_debugfs_histogram_fops);
+
+	// Only filled in if the cpu_accounting module parameter is enabled.
+	debugfs_create_file("cpu_time", 0444, unart->debugfs_dir, unart,
+			    &unart_debugfs_cpu_time_fops);
+
+	return devm_add_action_or_reset(&pdev->dev, unart_debugfs_device_cleanup, unart);
+}
+
+
+void unart_debugfs_init(void)
+{
+	unart_debugfs_root = debugfs_create_dir("unart", NULL);
+}
+
+void unart_debugfs_exit(void)
+{
+	debugfs_remove_recursive(unart_debugfs_root);
+}
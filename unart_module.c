@@ -5,29 +5,124 @@
  */
 #include "unart.h"
 
+#define CREATE_TRACE_POINTS
+#include "unart_trace.h"
+
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/errno.h>
 #include <linux/gpio/machine.h>
 #include <linux/init.h>
+#include <linux/jump_label.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
 #include <linux/printk.h>
+#include <linux/sched.h>
 #include <linux/stringify.h>
+#include <uapi/linux/sched/types.h>
 
 struct unart_module_params unart_params = {
 	.gpiochip = NULL,
 	.rx_gpio = -1,
 	.tx_gpio = -1,
 	.rx_skew = UNART_DEFAULT_RX_SKEW,
+	.rx_skew_auto = false,
+	.rx_vote_spacing = 0,
+	.autobaud = false,
+	.rx_mode = UNART_DEFAULT_RX_MODE,
+	.rx_fifo_size = UNART_DEFAULT_RX_FIFO_SIZE,
+	.rx_threshold = 0,
+	.rx_match_char = -1,
+	.rx_idle_timeout = UNART_DEFAULT_RX_IDLE_TIMEOUT,
+	.rx_stream_bits = UNART_DEFAULT_RX_STREAM_BITS,
+	.rx_mask_irq = true,
+	.modbus_rtu = false,
 	.rx_debug = false,
+	.tx_low_watermark = UNART_DEFAULT_TX_LOW_WATERMARK,
+	.tx_spin_budget = UNART_DEFAULT_TX_SPIN_BUDGET,
+	.tx_shared_clock = false,
+	.poll_cpu = -1,
+	.cpu_latency = -1,
+	.cpu_spread = false,
+	.worker_priority = 0,
+	.worker_cpu = -1,
+	.histograms = false,
+	.cpu_accounting = false,
+};
+
+struct kthread_worker *unart_worker;
+
+DEFINE_STATIC_KEY_FALSE(unart_histograms_enabled);
+DEFINE_STATIC_KEY_FALSE(unart_cpu_accounting_enabled);
+
+static int unart_histograms_param_set(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+	if (err)
+		return err;
+
+	if (unart_params.histograms)
+		static_branch_enable(&unart_histograms_enabled);
+	else
+		static_branch_disable(&unart_histograms_enabled);
+
+	return 0;
+}
+
+static const struct kernel_param_ops unart_histograms_param_ops = {
+	.set = unart_histograms_param_set,
+	.get = param_get_bool,
+};
+
+static int unart_cpu_accounting_param_set(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+	if (err)
+		return err;
+
+	if (unart_params.cpu_accounting)
+		static_branch_enable(&unart_cpu_accounting_enabled);
+	else
+		static_branch_disable(&unart_cpu_accounting_enabled);
+
+	return 0;
+}
+
+static const struct kernel_param_ops unart_cpu_accounting_param_ops = {
+	.set = unart_cpu_accounting_param_set,
+	.get = param_get_bool,
 };
 
 module_param_named(gpiochip, unart_params.gpiochip, charp, 0444);
 module_param_named(rx_gpio, unart_params.rx_gpio, int, 0444);
 module_param_named(tx_gpio, unart_params.tx_gpio, int, 0444);
 module_param_named(rx_skew, unart_params.rx_skew, int, 0444);
+module_param_named(rx_skew_auto, unart_params.rx_skew_auto, bool, 0444);
+module_param_named(rx_vote_spacing, unart_params.rx_vote_spacing, uint, 0444);
+module_param_named(autobaud, unart_params.autobaud, bool, 0444);
+module_param_named(rx_mode, unart_params.rx_mode, charp, 0444);
+module_param_named(rx_fifo_size, unart_params.rx_fifo_size, uint, 0444);
+module_param_named(rx_threshold, unart_params.rx_threshold, uint, 0444);
+module_param_named(rx_match_char, unart_params.rx_match_char, int, 0444);
+module_param_named(rx_idle_timeout, unart_params.rx_idle_timeout, uint, 0444);
+module_param_named(rx_stream_bits, unart_params.rx_stream_bits, uint, 0444);
+module_param_named(rx_mask_irq, unart_params.rx_mask_irq, bool, 0444);
+module_param_named(modbus_rtu, unart_params.modbus_rtu, bool, 0444);
 module_param_named(rx_debug, unart_params.rx_debug, bool, 0644);
+module_param_named(tx_low_watermark, unart_params.tx_low_watermark, uint, 0444);
+module_param_named(tx_spin_budget, unart_params.tx_spin_budget, uint, 0444);
+module_param_named(tx_shared_clock, unart_params.tx_shared_clock, bool, 0444);
+module_param_named(poll_cpu, unart_params.poll_cpu, int, 0444);
+module_param_named(cpu_latency, unart_params.cpu_latency, int, 0444);
+module_param_named(cpu_spread, unart_params.cpu_spread, bool, 0444);
+module_param_named(worker_priority, unart_params.worker_priority, int, 0444);
+module_param_named(worker_cpu, unart_params.worker_cpu, int, 0444);
+module_param_cb(histograms, &unart_histograms_param_ops, &unart_params.histograms, 0644);
+module_param_cb(cpu_accounting, &unart_cpu_accounting_param_ops,
+		&unart_params.cpu_accounting, 0644);
 
 MODULE_PARM_DESC(gpiochip, "GPIO chip for RX and TX");
 MODULE_PARM_DESC(rx_gpio, "GPIO index for RX");
@@ -43,6 +138,116 @@ MODULE_PARM_DESC(tx_gpio, "GPIO index for TX");
  */
 MODULE_PARM_DESC(rx_skew, "sample offset for RX (0-100, default "
 			  __stringify(UNART_DEFAULT_RX_SKEW)")");
+/**
+ * Calibrate the RX sample offset continuously while receiving, instead of
+ * using rx_skew. The lateness of every sample is measured, and the offset is
+ * adjusted after each frame so that samples end up in the center of each bit
+ * on average. rx_skew is only used until the first frame has been received.
+ * The current value is shown in the rx_skew sysfs attribute of each TTY
+ * device, and calibration can be toggled there with rx_skew_auto. The
+ * "rx-skew-auto" DT property does the same for individual instances.
+ */
+MODULE_PARM_DESC(rx_skew_auto, "calibrate RX sample offset automatically");
+/**
+ * Take three samples per bit instead of one, this many nanoseconds apart and
+ * centered on the sample offset, and use the majority. This filters out short
+ * glitches on noisy lines, at the cost of spending twice the spacing in each
+ * timer callback. The spacing is limited to a tenth of the bit period.
+ * Disagreements are counted in debugfs. Only used in "sample" mode and with
+ * polling. 0 disables this. The "rx-vote-spacing" DT property does the same
+ * for individual instances.
+ */
+MODULE_PARM_DESC(rx_vote_spacing, "RX majority vote sample spacing in ns (default 0)");
+/**
+ * Detect the baud rate from the first few received frames each time a port
+ * is opened, instead of using the configured one. The shortest interval
+ * between any two edges on the RX line is taken as the bit period, and
+ * snapped to the nearest standard baud rate. Data received during detection
+ * is discarded.
+ * The detected rate replaces the port's configured speed, and is announced
+ * with a KOBJ_CHANGE uevent carrying UNART_BAUD_RATE. The "autobaud" DT
+ * property or sysfs attribute does the same for individual instances.
+ * Not supported in "bank" mode or with polling.
+ */
+MODULE_PARM_DESC(autobaud, "detect baud rate when opening a port");
+/**
+ * How RX frames are decoded.
+ * "sample" starts the hrtimer on the falling edge of the start bit, and then
+ * samples the line once per bit.
+ * "edge" timestamps every edge in the IRQ handler, and reconstructs the whole
+ * frame from the edge intervals once the stop bit has passed. This takes one
+ * IRQ per level transition instead of one per bit, and doesn't depend on
+ * hrtimer wakeup jitter.
+ * "bank" doesn't use IRQs at all. Instead, the RX lines of all instances on
+ * the same GPIO controller and with the same baud rate are sampled together
+ * by one timer, at 4 times the baud rate. This scales to many instances, but
+ * the timer keeps running for as long as any of them is open.
+ */
+MODULE_PARM_DESC(rx_mode, "RX decoder (sample, edge, bank, default "
+			  UNART_DEFAULT_RX_MODE")");
+/**
+ * Size of the RX FIFO in bytes, rounded up to a power of 2, up to 64 KiB.
+ * Received bytes wait there until they're pushed to the TTY layer from a
+ * workqueue. If that is delayed for too long under load, further bytes are
+ * lost, counted as overruns, and reported to user space as TTY_OVERRUN.
+ * The "rx-fifo-size" DT property does the same for individual instances.
+ */
+MODULE_PARM_DESC(rx_fifo_size, "RX FIFO size in bytes (default "
+			       __stringify(UNART_DEFAULT_RX_FIFO_SIZE)")");
+/**
+ * Number of received bytes after which they are pushed to the TTY layer.
+ * Values above 1 reduce the number of wakeups when receiving continuous
+ * streams of data, like the FIFO trigger level of a 16550. By default (0),
+ * this is 1, or half the RX FIFO if rx_match_char is used.
+ */
+MODULE_PARM_DESC(rx_threshold, "RX FIFO level for pushing data (1-rx_fifo_size, default "
+			       __stringify(UNART_DEFAULT_RX_THRESHOLD)")");
+/**
+ * Push received data to the TTY layer as soon as this character arrives,
+ * e.g. 10 for '\n' or 0x7e for HDLC-style framing, so that line or message
+ * oriented readers are woken up once per message rather than once per byte.
+ * Unless rx_threshold is set as well, the threshold is raised to half the
+ * RX FIFO in that case. -1 disables this.
+ * The "rx-match-char" DT property does the same for individual instances,
+ * and it can be changed at runtime in the TTY device's sysfs directory.
+ */
+MODULE_PARM_DESC(rx_match_char, "RX character that triggers a push (default -1, none)");
+/**
+ * Number of character times the RX line has to be idle before data below the
+ * threshold is pushed to the TTY layer.
+ */
+MODULE_PARM_DESC(rx_idle_timeout, "RX idle timeout in character times (default "
+				  __stringify(UNART_DEFAULT_RX_IDLE_TIMEOUT)")");
+/**
+ * Number of bit times to keep sampling the RX line after a valid stop bit, in
+ * "sample" mode. If the start bit of another frame is found during that time,
+ * it is received without waiting for the IRQ handler, which keeps continuous
+ * streams of data in sync at higher baud rates.
+ * The line is sampled at 4 times the baud rate while looking for the start
+ * bit. 0 disables this, and the maximum is 100.
+ */
+MODULE_PARM_DESC(rx_stream_bits, "RX bit times to look for back-to-back frames (default "
+				 __stringify(UNART_DEFAULT_RX_STREAM_BITS)")");
+/**
+ * Disable the RX IRQ while a frame is being sampled in "sample" mode, instead
+ * of handling and ignoring every falling edge within the frame.
+ * Disabling is lazy, so the IRQ is only masked in hardware if another edge
+ * actually occurs. Turn this off if enabling and masking the IRQ is expensive
+ * on a particular GPIO controller. The "rx-no-mask-irq" DT property does the
+ * same for individual instances.
+ */
+MODULE_PARM_DESC(rx_mask_irq, "mask RX IRQ during frames (default 1)");
+/**
+ * Assemble Modbus RTU frames from received data. A frame ends after t3.5 of
+ * silence on the RX line (3.5 character times, or 1.75 ms above 19200 baud),
+ * and is then pushed to the TTY layer in one go, so a single read() returns
+ * a whole frame. rx_threshold, rx_idle_timeout and rx_match_char don't apply,
+ * and the RX FIFO is enlarged to hold at least a maximum size frame of 256
+ * bytes.
+ * Gaps of more than t1.5 within a frame are counted in debugfs.
+ * The "modbus-rtu" DT property does the same for individual instances.
+ */
+MODULE_PARM_DESC(modbus_rtu, "Modbus RTU framing on RX");
 /**
  * Repurpose the TX line to measure the timing of RX sampling.
  * When enabled, all TX data is ignored. Instead the TX line is toggled every
@@ -50,6 +255,89 @@ MODULE_PARM_DESC(rx_skew, "sample offset for RX (0-100, default "
  * with the signal.
  */
 MODULE_PARM_DESC(rx_debug, "toggle TX line when RX is sampled");
+/**
+ * Number of bytes left in the TX FIFO at which writers are woken up.
+ * Waking up before the FIFO runs dry gives user space time to refill it while
+ * the remaining bytes are still being sent, so the line doesn't go idle
+ * between writes.
+ */
+MODULE_PARM_DESC(tx_low_watermark, "TX FIFO level for waking up writers (default "
+				   __stringify(UNART_DEFAULT_TX_LOW_WATERMARK)")");
+/**
+ * Maximum time in microseconds the TX timer callback may busy-wait for the
+ * next level transitions, with IRQs disabled, instead of restarting the timer
+ * for each of them.
+ * At high baud rates, where a bit period isn't much longer than the overhead
+ * of a timer IRQ, a budget of one or a few character times sends entire bytes
+ * from a single IRQ with much more accurate timing. The cost is that nothing
+ * else runs on that CPU in the meantime, so keep this small. It is limited to
+ * 200 us. 0 disables spinning. The "tx-spin-budget" DT property does the same
+ * for individual instances.
+ */
+MODULE_PARM_DESC(tx_spin_budget, "TX busy-wait budget per timer IRQ in us (default "
+				 __stringify(UNART_DEFAULT_TX_SPIN_BUDGET)")");
+/**
+ * Drive TX from a bit clock shared by all instances with the same baud rate,
+ * instead of a separate timer per instance. All TX lines of a group are set
+ * at once on every tick, which scales much better with many instances, at the
+ * cost of one timer IRQ per bit instead of one per level transition.
+ * The "tx-shared-clock" DT property does the same for individual instances.
+ */
+MODULE_PARM_DESC(tx_shared_clock, "drive TX from a shared bit clock");
+/**
+ * Drive RX and TX from a real-time kernel thread bound to this CPU, which
+ * busy-polls the lines while the port is open, instead of using IRQs and
+ * hrtimers. This takes the CPU away from everything else, but gives much
+ * better timing at high baud rates. The CPU should be isolated with isolcpus,
+ * and RT throttling should be disabled. Instances on the same CPU share one
+ * thread, and "rx_mode" is ignored.
+ * The "poll-cpu" DT property does the same for individual instances, and it
+ * can be changed in sysfs while the port is closed. -1 disables polling.
+ */
+MODULE_PARM_DESC(poll_cpu, "CPU for busy-polling RX and TX (default -1)");
+/**
+ * Maximum CPU wakeup latency in microseconds while a port is open, enforced
+ * with a PM QoS request so that deep idle states don't delay the RX IRQ and
+ * timers. By default (-1), this is derived from the baud rate and RX skew:
+ * the IRQ and the sampling timer together may be late by up to the time
+ * between the sample point and the end of the bit. Not used with polling.
+ * The "cpu-latency-us" DT property does the same for individual instances.
+ */
+MODULE_PARM_DESC(cpu_latency, "CPU wakeup latency limit in us while open (default -1, auto)");
+/**
+ * Pin the RX IRQ and the RX and TX timers of each instance to one CPU,
+ * distributing instances across all online CPUs in order of their port
+ * numbers. Instances with a "cpu-affinity" DT property use that CPU instead.
+ * The CPU of each instance can also be changed in sysfs.
+ * Shared timers (RX bank and TX shared clock) are not affected.
+ */
+MODULE_PARM_DESC(cpu_spread, "spread instances across CPUs");
+/**
+ * Push received data to the TTY layer and wake up writers from a dedicated
+ * kthread_worker running at this SCHED_FIFO priority (1-99), shared by all
+ * instances, instead of the system workqueue. This keeps RX latency bounded
+ * when the system is busy with other work. With the default of 0, the system
+ * workqueue is used.
+ */
+MODULE_PARM_DESC(worker_priority, "SCHED_FIFO priority of the RX/TX worker thread "
+				  "(default 0, none)");
+/**
+ * CPU to bind the worker thread to. By default (-1), it may run on any CPU.
+ * Only used if worker_priority is set.
+ */
+MODULE_PARM_DESC(worker_cpu, "CPU for the RX/TX worker thread (default -1, any)");
+/**
+ * Record timer lateness and IRQ latency histograms for each instance, which
+ * can be found in debugfs. This can be enabled and disabled at runtime, and
+ * costs next to nothing while disabled.
+ */
+MODULE_PARM_DESC(histograms, "record timing histograms in debugfs");
+/**
+ * Measure the CPU time spent in the IRQ handler and timer callbacks of each
+ * instance, which can be found in debugfs. Like histograms, this can be
+ * toggled at runtime, and costs next to nothing while disabled.
+ */
+MODULE_PARM_DESC(cpu_accounting, "measure IRQ and timer CPU time per instance");
 
 
 static struct platform_device *manual_pdev;
@@ -119,10 +407,18 @@ static int unart_probe(struct platform_device *pdev)
 	if (err)
 		return err;
 
+	err = unart_poll_setup(pdev, unart);
+	if (err)
+		return err;
+
 	err = unart_tty_device_setup(pdev, unart);
 	if (err)
 		return err;
 
+	err = unart_debugfs_device_setup(pdev, unart);
+	if (err)
+		return err;
+
 	return 0;
 }
 
@@ -141,24 +437,85 @@ static struct platform_driver unart_driver = {
 	}
 };
 
+static int unart_worker_init(void)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = unart_params.worker_priority,
+	};
+	int cpu = unart_params.worker_cpu;
+	struct kthread_worker *worker;
+	int err;
+
+	if (!unart_params.worker_priority)
+		return 0;
+
+	if (unart_params.worker_priority < 0 ||
+	    unart_params.worker_priority >= MAX_RT_PRIO) {
+		pr_err("unart: Invalid worker priority %d\n", unart_params.worker_priority);
+		return -EINVAL;
+	}
+
+	if (cpu < -1 || cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu))) {
+		pr_err("unart: Invalid worker CPU %d\n", cpu);
+		return -EINVAL;
+	}
+
+	worker = kthread_create_worker(0, "unart");
+	if (IS_ERR(worker))
+		return PTR_ERR(worker);
+
+	err = sched_setattr_nocheck(worker->task, &attr);
+	if (!err && cpu >= 0)
+		err = set_cpus_allowed_ptr(worker->task, cpumask_of(cpu));
+	if (err) {
+		kthread_destroy_worker(worker);
+		return err;
+	}
+
+	unart_worker = worker;
+	return 0;
+}
+
+static void unart_worker_exit(void)
+{
+	if (unart_worker) {
+		kthread_destroy_worker(unart_worker);
+		unart_worker = NULL;
+	}
+}
+
 static int unart_init(void)
 {
 	int err;
 
-	err = unart_tty_register_driver();
+	err = unart_worker_init();
 	if (err)
 		return err;
 
+	err = unart_tty_register_driver();
+	if (err) {
+		unart_worker_exit();
+		return err;
+	}
+
+	unart_debugfs_init();
+
 	err = platform_driver_register(&unart_driver);
 	if (err) {
+		unart_debugfs_exit();
 		unart_tty_unregister_driver();
+		unart_worker_exit();
 		return err;
 	}
 
 	err = unart_manual_device_init();
 	if (err) {
 		platform_driver_unregister(&unart_driver);
+		unart_debugfs_exit();
 		unart_tty_unregister_driver();
+		unart_worker_exit();
 		return err;
 	}
 
@@ -171,7 +528,9 @@ static void unart_exit(void)
 		platform_device_unregister(manual_pdev);
 
 	platform_driver_unregister(&unart_driver);
+	unart_debugfs_exit();
 	unart_tty_unregister_driver();
+	unart_worker_exit();
 }
 
 module_init(unart_init);
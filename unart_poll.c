@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * unart - definitely not a real UART
+ * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
+ */
+#include "unart.h"
+
+#include <linux/cpumask.h>
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/property.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/*
+ * A poller is a SCHED_FIFO thread bound to one CPU, which busy-polls the RX
+ * and TX lines of all active instances assigned to that CPU, instead of using
+ * IRQs and hrtimers. It never sleeps, so the CPU should be reserved for it,
+ * e.g. with isolcpus.
+ */
+struct unart_poller {
+	struct list_head node;
+	unsigned int cpu;
+	struct task_struct *thread;
+
+	struct list_head members;
+
+	raw_spinlock_t lock;
+};
+
+static LIST_HEAD(pollers);
+static DEFINE_MUTEX(pollers_mutex);
+
+
+static int unart_poll_thread(void *_poller)
+{
+	struct unart_poller *poller = _poller;
+	struct unart *unart;
+	unsigned long flags;
+
+	while (!kthread_should_stop()) {
+		ktime_t now = ktime_get();
+
+		raw_spin_lock_irqsave(&poller->lock, flags);
+
+		list_for_each_entry(unart, &poller->members, poll_node) {
+			unart_rx_poll(&unart->rx, now);
+			unart_tx_poll(&unart->tx, now);
+		}
+
+		raw_spin_unlock_irqrestore(&poller->lock, flags);
+
+		// Only gives up the CPU to higher priority tasks, and keeps
+		// non-preemptible kernels happy.
+		cond_resched();
+		cpu_relax();
+	}
+
+	return 0;
+}
+
+
+/**
+ * Start polling an instance on its configured CPU, creating the polling
+ * thread if necessary.
+ */
+int unart_poll_attach(struct unart *unart)
+{
+	struct unart_poller *poller;
+	unsigned long flags;
+
+	if (!cpu_online(unart->poll_cpu))
+		return -EINVAL;
+
+	mutex_lock(&pollers_mutex);
+
+	list_for_each_entry(poller, &pollers, node) {
+		if (poller->cpu == unart->poll_cpu)
+			goto found;
+	}
+
+	poller = kzalloc(sizeof(*poller), GFP_KERNEL);
+	if (!poller) {
+		mutex_unlock(&pollers_mutex);
+		return -ENOMEM;
+	}
+
+	poller->cpu = unart->poll_cpu;
+	INIT_LIST_HEAD(&poller->members);
+	raw_spin_lock_init(&poller->lock);
+
+	poller->thread = kthread_create_on_cpu(unart_poll_thread, poller,
+					       poller->cpu, "unart-poll/%u");
+	if (IS_ERR(poller->thread)) {
+		int err = PTR_ERR(poller->thread);
+		kfree(poller);
+		mutex_unlock(&pollers_mutex);
+		return err;
+	}
+
+	sched_set_fifo(poller->thread);
+	wake_up_process(poller->thread);
+	list_add(&poller->node, &pollers);
+
+found:
+	unart_rx_poll_reset(&unart->rx);
+	unart_tx_set_polled(&unart->tx, true);
+
+	raw_spin_lock_irqsave(&poller->lock, flags);
+	list_add_tail(&unart->poll_node, &poller->members);
+	raw_spin_unlock_irqrestore(&poller->lock, flags);
+
+	unart->poller = poller;
+
+	mutex_unlock(&pollers_mutex);
+	return 0;
+}
+
+/**
+ * Stop polling an instance. The polling thread is stopped once its last
+ * member is gone.
+ */
+void unart_poll_detach(struct unart *unart)
+{
+	struct unart_poller *poller = unart->poller;
+	unsigned long flags;
+
+	if (!poller)
+		return;
+
+	mutex_lock(&pollers_mutex);
+
+	raw_spin_lock_irqsave(&poller->lock, flags);
+	list_del(&unart->poll_node);
+	raw_spin_unlock_irqrestore(&poller->lock, flags);
+
+	unart->poller = NULL;
+
+	if (list_empty(&poller->members)) {
+		kthread_stop(poller->thread);
+		list_del(&poller->node);
+		kfree(poller);
+	}
+
+	mutex_unlock(&pollers_mutex);
+
+	unart_rx_poll_reset(&unart->rx);
+	unart_tx_set_polled(&unart->tx, false);
+}
+
+
+static void unart_poll_cleanup(void *_unart)
+{
+	unart_poll_detach(_unart);
+}
+
+int unart_poll_setup(struct platform_device *pdev, struct unart *unart)
+{
+	u32 cpu;
+
+	if (device_property_read_u32(&pdev->dev, "poll-cpu", &cpu) == 0)
+		unart->poll_cpu = cpu;
+	else
+		unart->poll_cpu = unart_params.poll_cpu;
+
+	if (unart->poll_cpu < -1 || unart->poll_cpu >= (int)nr_cpu_ids) {
+		dev_err(&pdev->dev, "Invalid polling CPU %d\n", unart->poll_cpu);
+		return -EINVAL;
+	}
+
+	return devm_add_action_or_reset(&pdev->dev, unart_poll_cleanup, unart);
+}
@@ -4,23 +4,44 @@
  * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
  */
 #include "unart.h"
+#include "unart_trace.h"
 #include "unart_util.h"
 
+#include <linux/bits.h>
 #include <linux/container_of.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/gpio/consumer.h>
 #include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/kfifo.h>
 #include <linux/ktime.h>
+#include <linux/math.h>
+#include <linux/math64.h>
 #include <linux/minmax.h>
 #include <linux/platform_device.h>
+#include <linux/printk.h>
 #include <linux/property.h>
 #include <linux/sched.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tty.h>
 #include <linux/workqueue.h>
 
 
+static const char * const unart_rx_mode_names[] = {
+	[UNART_RX_MODE_SAMPLE] = "sample",
+	[UNART_RX_MODE_EDGE] = "edge",
+	[UNART_RX_MODE_BANK] = "bank",
+};
+
+static const unsigned int unart_rx_autobaud_rates[] = {
+	300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400,
+};
+
+
 static inline void unart_rx_debug_toggle(struct unart_rx *rx)
 {
 	struct unart *unart = container_of(rx, struct unart, rx);
@@ -29,21 +50,444 @@ static inline void unart_rx_debug_toggle(struct unart_rx *rx)
 	gpiod_set_raw_value(unart->tx.gpio, rx->debug_toggle);
 }
 
+/**
+ * Add a character to the FIFO. Pushing it to the TTY buffer is deferred until
+ * the FIFO reaches the threshold, or until the line goes idle.
+ */
+static void unart_rx_put(struct unart_rx *rx, u8 ch, u8 flag)
+{
+	struct unart_rx_char c = { .ch = ch, .flag = flag };
+
+	if (!kfifo_put(&rx->fifo, c)) {
+		++rx->stats.overruns;
+		rx->overrun = true;
+		return;
+	}
+
+	if (flag == TTY_NORMAL)
+		++rx->stats.bytes;
+
+	// Modbus frames are only pushed once complete.
+	if (rx->modbus) {
+		++rx->frame_len;
+		return;
+	}
+
+	if (kfifo_len(&rx->fifo) >= rx->threshold ||
+	    (ch == rx->match_char && flag == TTY_NORMAL))
+		unart_queue_work(&rx->push_work);
+}
+
+/**
+ * Handle a valid frame.
+ */
+static void unart_rx_receive(struct unart_rx *rx, u8 payload)
+{
+	trace_unart_rx_frame(unart_rx_port(rx), payload);
+
+	rx->in_break = false;
+	unart_rx_put(rx, payload, TTY_NORMAL);
+}
+
+/**
+ * Drop an invalid frame.
+ */
+static void unart_rx_reject(struct unart_rx *rx, enum unart_rx_error error)
+{
+	trace_unart_rx_frame_error(unart_rx_port(rx), error);
+
+	if (error == UNART_RX_FALSE_START)
+		++rx->stats.false_starts;
+	else if (error == UNART_RX_FRAME_ERROR)
+		++rx->stats.frame_errors;
+	else
+		++rx->stats.breaks;
+}
+
+/**
+ * Handle a frame with a bad stop bit. It's passed on with TTY_FRAME, unless
+ * all its bits were low, which means the line is held low. That's reported
+ * as a single break, however long it lasts.
+ */
+static void unart_rx_bad_stop_bit(struct unart_rx *rx, u8 payload)
+{
+	if (payload != 0) {
+		unart_rx_reject(rx, UNART_RX_FRAME_ERROR);
+		rx->in_break = false;
+		unart_rx_put(rx, payload, TTY_FRAME);
+		return;
+	}
+
+	if (rx->in_break)
+		return;
+
+	unart_rx_reject(rx, UNART_RX_BREAK);
+	rx->in_break = true;
+	unart_rx_put(rx, 0, TTY_BREAK);
+}
+
+/**
+ * Feed the next sample of the current frame into the decoder, starting with
+ * the start bit.
+ * Returns false once the frame is complete or has been rejected.
+ */
+static bool unart_rx_decode_bit(struct unart_rx *rx, int bit)
+{
+	if (rx->bit_index == -1) {
+		if (bit != 0) {
+			// Start bit is invalid.
+			unart_rx_reject(rx, UNART_RX_FALSE_START);
+			return false;
+		}
+		rx->payload = 0;
+		++rx->bit_index;
+		return true;
+	}
+
+	if (rx->bit_index < 8) {
+		rx->payload = (bit << 7) | (rx->payload >> 1);
+		++rx->bit_index;
+		return true;
+	}
+
+	rx->bit_index = -1;
+
+	if (bit == 1)
+		// Stop bit is valid.
+		unart_rx_receive(rx, rx->payload);
+	else
+		unart_rx_bad_stop_bit(rx, rx->payload);
+
+	return false;
+}
+
+/**
+ * Record how late a sample was taken, for calibrating the skew.
+ */
+static void unart_rx_record_lateness(struct unart_rx *rx, ktime_t lateness)
+{
+	if (rx->skew_auto)
+		ewma_unart_latency_add(&rx->latency, max_t(s64, lateness, 0));
+}
+
+/**
+ * Move the sample point so that, given the typical latency, samples land in
+ * the center of each bit. The sample point is late by the latency of the
+ * start bit IRQ plus that of the timer. Without a hardware timestamp for the
+ * edge, the former can't be measured, and is assumed to be the same as the
+ * latter.
+ */
+static void unart_rx_calibrate_skew(struct unart_rx *rx)
+{
+	if (!rx->skew_auto)
+		return;
+
+	ktime_t latency = ewma_unart_latency_read(&rx->latency);
+	ktime_t center = rx->period / 2;
+
+	// Keep the configured skew until there's something to go by.
+	if (!latency)
+		return;
+
+	WRITE_ONCE(rx->skew, center - min(2 * latency, center));
+}
+
+/**
+ * Duration of a whole frame, start and stop bits included.
+ */
+static ktime_t unart_rx_frame_time(struct unart_rx *rx)
+{
+	return unart_clock_ns(rx->clock.period * 10);
+}
+
+/**
+ * Mark the end of a Modbus frame, and have it pushed.
+ */
+static void unart_rx_modbus_end_frame(struct unart_rx *rx)
+{
+	if (!rx->frame_len)
+		return;
+
+	// Can't fail, the ring has room for one entry per byte in the FIFO.
+	kfifo_put(&rx->frames, rx->frame_len);
+	rx->frame_len = 0;
+	unart_queue_work(&rx->push_work);
+}
+
+/**
+ * Drop anything left over from before the port was shut down, which may
+ * include an incomplete frame. Called while nothing is being received.
+ */
+static void unart_rx_modbus_reset(struct unart_rx *rx)
+{
+	if (!rx->modbus)
+		return;
+
+	unart_cancel_work_sync(&rx->push_work);
+	kfifo_reset(&rx->fifo);
+	kfifo_reset(&rx->frames);
+	rx->frame_len = 0;
+	rx->modbus_last_start = 0;
+}
+
+/**
+ * Check the silence before the start edge of a character in Modbus mode. A
+ * character more than t1.5 after the previous one is counted as a violation.
+ * One at least t3.5 after it starts a new frame, in case the idle timeout
+ * hasn't expired yet, allowing one bit time for IRQ latency.
+ */
+static void unart_rx_modbus_start(struct unart_rx *rx, ktime_t edge)
+{
+	if (!rx->modbus)
+		return;
+
+	ktime_t gap = edge - rx->modbus_last_start - unart_rx_frame_time(rx);
+	rx->modbus_last_start = edge;
+
+	if (!rx->frame_len)
+		return;
+
+	if (gap >= rx->idle_timeout - rx->period)
+		unart_rx_modbus_end_frame(rx);
+	else if (gap > rx->modbus_t15)
+		++rx->stats.modbus_t15_violations;
+}
+
+/**
+ * Time of the first sample of the start bit, given its falling edge. With
+ * majority voting, the middle one of the three samples is at the skew.
+ */
+static ktime_t unart_rx_sample_point(struct unart_rx *rx, ktime_t edge)
+{
+	return edge + max_t(ktime_t, rx->skew - rx->vote_spacing, 0);
+}
+
+/**
+ * Time from the first sample of the stop bit to the end of the frame.
+ */
+static ktime_t unart_rx_frame_tail(struct unart_rx *rx)
+{
+	return rx->period - max_t(ktime_t, rx->skew - rx->vote_spacing, 0);
+}
+
+/**
+ * Read the RX line. With majority voting, take three samples vote_spacing
+ * apart, and count how often they disagree.
+ */
+static int unart_rx_sample(struct unart_rx *rx)
+{
+	int a = gpiod_get_raw_value(rx->gpio);
+
+	if (!rx->vote_spacing)
+		return a;
+
+	ndelay(rx->vote_spacing);
+	int b = gpiod_get_raw_value(rx->gpio);
+	ndelay(rx->vote_spacing);
+	int c = gpiod_get_raw_value(rx->gpio);
+
+	if (a != b || b != c)
+		++rx->stats.vote_corrections;
+
+	return a + b + c >= 2;
+}
+
+/**
+ * Set the threshold from the configured one, if any. Otherwise, data is
+ * pushed right away, unless there's a match character. Pushing every byte
+ * would defeat that, so it's held back until half the FIFO is filled,
+ * leaving some headroom for bytes arriving before the push happens.
+ */
+static void unart_rx_update_threshold(struct unart_rx *rx)
+{
+	unsigned int threshold = rx->threshold_config;
+
+	if (!threshold)
+		threshold = rx->match_char != -1 ? kfifo_size(&rx->fifo) / 2
+						 : UNART_DEFAULT_RX_THRESHOLD;
+
+	rx->threshold = clamp(threshold, 1u, kfifo_size(&rx->fifo));
+}
+
+/**
+ * Returns true if there is data in the FIFO that will only be pushed after
+ * the idle timeout.
+ */
+static bool unart_rx_needs_idle_timeout(struct unart_rx *rx)
+{
+	if (rx->modbus)
+		return rx->frame_len != 0;
+
+	unsigned int len = kfifo_len(&rx->fifo);
+	return len != 0 && len < rx->threshold;
+}
+
+/**
+ * Arm the timer to push the remaining contents of the FIFO, unless the line
+ * becomes active again before the idle timeout expires.
+ * Returns false if there is nothing to push, or if a push has already been
+ * scheduled.
+ */
+static bool unart_rx_arm_idle_timeout(struct unart_rx *rx, ktime_t idle_since)
+{
+	if (!unart_rx_needs_idle_timeout(rx))
+		return false;
+
+	rx->flush_pending = true;
+	hrtimer_set_expires(&rx->timer, idle_since + rx->idle_timeout);
+	return true;
+}
+
+/**
+ * Handle an expired idle timeout.
+ */
+static void unart_rx_flush(struct unart_rx *rx)
+{
+	rx->flush_pending = false;
+
+	if (rx->modbus)
+		unart_rx_modbus_end_frame(rx);
+	else
+		unart_queue_work(&rx->push_work);
+}
+
+/**
+ * Re-enable the IRQ after it was masked for the duration of a frame.
+ */
+static void unart_rx_unmask_irq(struct unart_rx *rx)
+{
+	if (!rx->irq_masked)
+		return;
+
+	rx->irq_masked = false;
+	rx->irq_replay = true;
+	enable_irq(rx->irq);
+}
+
+/**
+ * Go back to waiting for the IRQ handler to detect the next start bit.
+ */
+static enum hrtimer_restart unart_rx_idle(struct unart_rx *rx, struct hrtimer *timer)
+{
+	unart_rx_unmask_irq(rx);
+
+	// The timer expired at the stop bit's sample point, the gap starts
+	// at the end of the frame.
+	if (unart_rx_arm_idle_timeout(rx, hrtimer_get_expires(timer) + unart_rx_frame_tail(rx)))
+		return HRTIMER_RESTART;
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Advance the clock by one tick while looking for a start bit.
+ */
+static ktime_t unart_rx_advance_hunt(struct unart_rx *rx)
+{
+	return unart_clock_advance(&rx->clock, rx->clock.period / UNART_RX_OVERSAMPLING);
+}
+
+/**
+ * Find the standard baud rate with a bit period close to the given one.
+ * Returns 0 if there is none.
+ */
+static unsigned int unart_rx_autobaud_match(ktime_t bit_time)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(unart_rx_autobaud_rates); ++i) {
+		unsigned int rate = unart_rx_autobaud_rates[i];
+		s64 period = NSEC_PER_SEC / rate;
+
+		// Adjacent rates are at least a factor of 1.5 apart.
+		if (abs(bit_time - period) <= period / 8)
+			return rate;
+	}
+
+	return 0;
+}
+
+/**
+ * Handle an RX edge while detecting the baud rate. The shortest interval
+ * between any two edges is taken to be one bit. Detection starts over if
+ * that doesn't match any standard rate.
+ */
+static void unart_rx_autobaud_edge(struct unart_rx *rx, ktime_t now)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	++rx->stats.irqs;
+
+	// Already done, waiting for the new rate to be applied.
+	if (rx->autobaud_rate)
+		return;
+
+	ktime_t interval = now - rx->autobaud_last;
+	rx->autobaud_last = now;
+
+	if (rx->autobaud_edges++ == 0)
+		return;
+
+	rx->autobaud_min = min(rx->autobaud_min, interval);
+
+	if (rx->autobaud_edges < UNART_AUTOBAUD_EDGES)
+		return;
+
+	rx->autobaud_rate = unart_rx_autobaud_match(rx->autobaud_min);
+	rx->autobaud_edges = 0;
+	rx->autobaud_min = KTIME_MAX;
+
+	if (rx->autobaud_rate)
+		schedule_work(&rx->autobaud_work);
+}
+
 static irqreturn_t unart_rx_irq_handler(int irq, void *_rx)
 {
 	struct unart_rx *rx = _rx;
 	ktime_t now = ktime_get();
 
+	if (unlikely(rx->autobaud_active)) {
+		unart_rx_autobaud_edge(rx, now);
+		return IRQ_HANDLED;
+	}
+
 	raw_spin_lock_irqsave_scoped(&rx->lock);
+	unart_cpu_time_scoped(&rx->stats.irq_time);
 
-	// Ignore falling edges while a byte is being read.
-	// It would be better if we could mask the IRQ somehow...
-	if (rx->bit_index != -1 || hrtimer_active(&rx->timer))
+	++rx->stats.irqs;
+
+	// Ignore falling edges while a byte is being read. This only happens
+	// if the IRQ isn't masked during frames.
+	if (rx->bit_index != -1 ||
+	    (hrtimer_active(&rx->timer) && !rx->flush_pending))
 		return IRQ_HANDLED;
 
+	// A falling edge, replayed or not, means the line has been high since
+	// the last frame started, so any break is over.
+	rx->in_break = false;
+
+	// The first IRQ after unmasking may be a replay of an edge that
+	// happened during the previous frame. A real start bit would still
+	// be low.
+	if (rx->irq_replay) {
+		rx->irq_replay = false;
+		if (gpiod_get_raw_value(rx->gpio) != 0)
+			return IRQ_HANDLED;
+	}
+
+	trace_unart_rx_start_edge(unart_rx_port(rx));
+	unart_rx_modbus_start(rx, now);
+
+	// The line is active again, so don't push yet.
+	rx->flush_pending = false;
 	rx->payload = 0;
 
-	hrtimer_start(&rx->timer, now + rx->skew, HRTIMER_MODE_ABS_HARD);
+	unart_clock_reset(&rx->clock, unart_rx_sample_point(rx, now));
+	hrtimer_start(&rx->timer, rx->clock.time, unart_hrtimer_mode(rx->cpu));
+
+	// Stop further IRQs until the frame is complete. The timer callback
+	// takes care of everything else.
+	if (rx->mask_irq) {
+		disable_irq_nosync(irq);
+		rx->irq_masked = true;
+	}
 
 	if (unlikely(unart_params.rx_debug))
 		unart_rx_debug_toggle(rx);
@@ -56,45 +500,493 @@ static enum hrtimer_restart unart_rx_timer_callback(struct hrtimer *timer)
 	struct unart_rx *rx = container_of(timer, struct unart_rx, timer);
 
 	raw_spin_lock_irqsave_scoped(&rx->lock);
+	unart_cpu_time_scoped(&rx->stats.timer_time);
 
-	int bit = gpiod_get_raw_value(rx->gpio);
+	// The IRQ handler restarted the timer while this callback was waiting
+	// for the lock, e.g. a start bit racing with the idle timeout. The new
+	// expiry time takes precedence.
+	if (hrtimer_is_queued(timer))
+		return HRTIMER_NORESTART;
+
+	++rx->stats.timer_callbacks;
+	unart_histogram_add_lateness(&rx->stats.timer_lateness, timer);
+
+	if (rx->flush_pending) {
+		unart_rx_flush(rx);
+		return HRTIMER_NORESTART;
+	}
+
+	int bit = unart_rx_sample(rx);
 
 	if (unlikely(unart_params.rx_debug))
 		unart_rx_debug_toggle(rx);
 
-	if (rx->bit_index == -1) {
-		if (bit != 0)
-			// Start bit is invalid.
-			return HRTIMER_NORESTART;
-		++rx->bit_index;
+	if (rx->hunt_ticks) {
+		if (bit == 0) {
+			// Start bit of the next frame. The falling edge happened
+			// somewhere since the previous tick, so assume it was
+			// right in the middle.
+			ktime_t edge = hrtimer_get_expires(timer) - rx->hunt_tick / 2;
 
-	} else if (rx->bit_index < 8) {
-		rx->payload = (bit << 7) | (rx->payload >> 1);
-		++rx->bit_index;
+			trace_unart_rx_start_edge(unart_rx_port(rx));
+			unart_rx_modbus_start(rx, edge);
 
-	} else {
-		if (bit == 1) {
-			// Stop bit is valid. Add payload to FIFO and
-			// schedule pushing it to TTY buffer.
-			kfifo_put(&rx->fifo, rx->payload);
-			schedule_work(&rx->push_work);
+			rx->hunt_ticks = 0;
+			rx->bit_index = 0;
+			rx->payload = 0;
+			unart_clock_reset(&rx->clock, unart_rx_sample_point(rx, edge));
+			hrtimer_set_expires(timer, unart_clock_advance(&rx->clock, rx->clock.period));
+			return HRTIMER_RESTART;
 		}
-		rx->bit_index = -1;
-		return HRTIMER_NORESTART;
+
+		if (--rx->hunt_ticks == 0)
+			// No further frame, leave it to the IRQ handler.
+			return unart_rx_idle(rx, timer);
+
+		hrtimer_set_expires(timer, unart_rx_advance_hunt(rx));
+		return HRTIMER_RESTART;
+	}
+
+	if (trace_unart_rx_bit_enabled() || rx->skew_auto) {
+		// Voting takes twice the spacing.
+		ktime_t lateness = ktime_get() - hrtimer_get_expires(timer) -
+				   2 * rx->vote_spacing;
+		trace_unart_rx_bit(unart_rx_port(rx), rx->bit_index, bit, lateness);
+		unart_rx_record_lateness(rx, lateness);
+	}
+
+	bool stop_bit = rx->bit_index == 8;
+
+	if (!unart_rx_decode_bit(rx, bit)) {
+		unart_rx_calibrate_skew(rx);
+
+		// Keep looking for the start bit of a back-to-back frame
+		// without waiting for the IRQ.
+		if (stop_bit && bit == 1 && rx->stream_bits) {
+			rx->hunt_ticks = rx->stream_bits * UNART_RX_OVERSAMPLING;
+			hrtimer_set_expires(timer, unart_rx_advance_hunt(rx));
+			return HRTIMER_RESTART;
+		}
+
+		return unart_rx_idle(rx, timer);
 	}
 
-	hrtimer_forward_now(timer, rx->period);
+	hrtimer_set_expires(timer, unart_clock_advance(&rx->clock, rx->clock.period));
 	return HRTIMER_RESTART;
 }
 
-static void unart_rx_push_work(struct work_struct *push_work)
+
+static irqreturn_t unart_rx_edge_irq_handler(int irq, void *_rx)
+{
+	struct unart_rx *rx = _rx;
+	ktime_t now = ktime_get();
+
+	if (unlikely(rx->autobaud_active)) {
+		unart_rx_autobaud_edge(rx, now);
+		return IRQ_HANDLED;
+	}
+
+	// This handler is the only producer, so the ring itself doesn't need
+	// the lock. If it overflows, the edge is lost and the current frame
+	// will most likely be rejected.
+	kfifo_put(&rx->edges, now);
+
+	if (unlikely(unart_params.rx_debug))
+		unart_rx_debug_toggle(rx);
+
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+	unart_cpu_time_scoped(&rx->stats.irq_time);
+
+	++rx->stats.irqs;
+
+	if (!rx->decoding || rx->flush_pending) {
+		// Decode once the (potential) stop bit has passed. The
+		// callback will take care of any edges that follow.
+		rx->decoding = true;
+		rx->flush_pending = false;
+		hrtimer_start(&rx->timer, now + unart_rx_frame_time(rx),
+			      unart_hrtimer_mode(rx->cpu));
+	}
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * Record how far an edge is off from the bit boundary it belongs to.
+ * Without hardware timestamps, the start edge is the only reference, so this
+ * is the IRQ latency of each edge relative to that of the start edge.
+ */
+static void unart_rx_edge_record_latency(struct unart_rx *rx, ktime_t edge)
+{
+	if (!static_branch_unlikely(&unart_histograms_enabled))
+		return;
+
+	s64 offset = edge - rx->frame_start;
+	s64 bits = div64_s64(offset + rx->period / 2, rx->period);
+	unart_histogram_add(&rx->stats.irq_latency, abs(offset - bits * rx->period));
+}
+
+/**
+ * Reconstruct one frame from the edge timestamps in the ring, starting at
+ * rx->frame_start. Edges after the center of the stop bit are left in the
+ * ring, as they belong to the next frame.
+ */
+static void unart_rx_edge_decode(struct unart_rx *rx)
+{
+	ktime_t edge;
+	unsigned int frame = 0;
+
+	for (int i = 0; i < 10; ++i) {
+		// Edge timestamps don't suffer from timer jitter, so the
+		// center of each bit is the best place to look.
+		ktime_t sample = rx->frame_start +
+				 unart_clock_ns(rx->clock.period * (2 * i + 1) / 2);
+
+		while (kfifo_peek(&rx->edges, &edge) && edge <= sample) {
+			kfifo_skip(&rx->edges);
+			rx->level ^= 1;
+			unart_rx_edge_record_latency(rx, edge);
+		}
+
+		frame |= rx->level << i;
+	}
+
+	// Start bit must be low, stop bit must be high.
+	if (frame & BIT(0))
+		unart_rx_reject(rx, UNART_RX_FALSE_START);
+	else if (!(frame & BIT(9)))
+		unart_rx_bad_stop_bit(rx, (frame >> 1) & 0xff);
+	else
+		unart_rx_receive(rx, (frame >> 1) & 0xff);
+}
+
+static enum hrtimer_restart unart_rx_edge_timer_callback(struct hrtimer *timer)
+{
+	struct unart_rx *rx = container_of(timer, struct unart_rx, timer);
+	ktime_t now = ktime_get();
+	ktime_t edge;
+
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+	unart_cpu_time_scoped(&rx->stats.timer_time);
+
+	// The IRQ handler restarted the timer while this callback was waiting
+	// for the lock, e.g. a start bit racing with the idle timeout. The new
+	// expiry time takes precedence.
+	if (hrtimer_is_queued(timer))
+		return HRTIMER_NORESTART;
+
+	++rx->stats.timer_callbacks;
+	unart_histogram_add_lateness(&rx->stats.timer_lateness, timer);
+
+	if (rx->flush_pending) {
+		unart_rx_flush(rx);
+		rx->decoding = false;
+		return HRTIMER_NORESTART;
+	}
+
+	while (kfifo_peek(&rx->edges, &edge)) {
+		if (rx->level == 0) {
+			// Line is still low after a broken frame. This edge
+			// brings it back to idle.
+			kfifo_skip(&rx->edges);
+			rx->level = 1;
+			rx->in_break = false;
+			continue;
+		}
+
+		// Falling edge while idle, this is a start bit. Leave it in
+		// the ring until the whole frame has passed.
+		ktime_t frame_end = edge + unart_rx_frame_time(rx);
+		if (frame_end > now) {
+			hrtimer_set_expires(timer, frame_end);
+			return HRTIMER_RESTART;
+		}
+
+		trace_unart_rx_start_edge(unart_rx_port(rx));
+		unart_rx_modbus_start(rx, edge);
+
+		kfifo_skip(&rx->edges);
+		rx->frame_start = edge;
+		rx->level = 0;
+		unart_rx_edge_decode(rx);
+	}
+
+	// Resynchronize with the actual line level if we got out of step,
+	// e.g. after a missed edge.
+	if (rx->level == 0)
+		rx->level = gpiod_get_raw_value(rx->gpio);
+
+	if (unart_rx_arm_idle_timeout(rx, rx->frame_start + unart_rx_frame_time(rx)))
+		return HRTIMER_RESTART;
+
+	rx->decoding = false;
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Forget about edges left over from before the port was shut down.
+ */
+static void unart_rx_edge_reset(struct unart_rx *rx)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	if (!rx->decoding) {
+		kfifo_reset(&rx->edges);
+		rx->level = 1;
+	}
+}
+
+
+/**
+ * Process one sample of the RX line in "bank" mode, taken at
+ * UNART_RX_OVERSAMPLING times the baud rate. Called with the bank's lock held.
+ */
+void unart_rx_bank_sample(struct unart_rx *rx, int bit, ktime_t lateness)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+	unart_cpu_time_scoped(&rx->stats.timer_time);
+
+	if (rx->bit_index == -1 && rx->bank_ticks == 0) {
+		if (bit == 0) {
+			// The falling edge happened since the previous sample.
+			// Check again in the middle of the start bit.
+			trace_unart_rx_start_edge(unart_rx_port(rx));
+			unart_rx_modbus_start(rx, ktime_get());
+			rx->bank_ticks = UNART_RX_OVERSAMPLING / 2;
+			return;
+		}
+
+		rx->in_break = false;
+		if (rx->idle_ticks && --rx->idle_ticks == 0)
+			unart_rx_flush(rx);
+		return;
+	}
+
+	if (--rx->bank_ticks)
+		return;
+
+	if (unlikely(unart_params.rx_debug))
+		unart_rx_debug_toggle(rx);
+
+	rx->bank_ticks = UNART_RX_OVERSAMPLING;
+
+	trace_unart_rx_bit(unart_rx_port(rx), rx->bit_index, bit, lateness);
+
+	if (unart_rx_decode_bit(rx, bit)) {
+		rx->idle_ticks = 0;
+		return;
+	}
+
+	rx->bank_ticks = 0;
+
+	if (unart_rx_needs_idle_timeout(rx))
+		rx->idle_ticks = rx->bank_idle_ticks;
+}
+
+/**
+ * Reset the state machine before joining a bank.
+ */
+void unart_rx_bank_reset(struct unart_rx *rx)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	rx->bit_index = -1;
+	rx->bank_ticks = 0;
+	rx->idle_ticks = 0;
+}
+
+
+/**
+ * Process the RX line from a polling thread, which calls this as often as it
+ * can. The start bit is found by watching the line, the following bits are
+ * sampled as soon as they're due.
+ */
+void unart_rx_poll(struct unart_rx *rx, ktime_t now)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	if (!rx->poll_sampling) {
+		int level = gpiod_get_raw_value(rx->gpio);
+
+		if (level == 0 && rx->poll_level != 0) {
+			trace_unart_rx_start_edge(unart_rx_port(rx));
+			unart_rx_modbus_start(rx, now);
+
+			// The line is active again, so don't push yet.
+			rx->flush_pending = false;
+			rx->poll_sampling = true;
+			unart_clock_reset(&rx->clock, unart_rx_sample_point(rx, now));
+		} else if (rx->flush_pending && now >= rx->poll_flush_time) {
+			unart_rx_flush(rx);
+		}
+
+		if (level != 0)
+			rx->in_break = false;
+		rx->poll_level = level;
+		return;
+	}
+
+	if (now < rx->clock.time)
+		return;
+
+	int bit = unart_rx_sample(rx);
+
+	if (unlikely(unart_params.rx_debug))
+		unart_rx_debug_toggle(rx);
+
+	unart_histogram_add(&rx->stats.timer_lateness, now - rx->clock.time);
+	trace_unart_rx_bit(unart_rx_port(rx), rx->bit_index, bit, now - rx->clock.time);
+	unart_rx_record_lateness(rx, now - rx->clock.time);
+
+	if (unart_rx_decode_bit(rx, bit)) {
+		unart_clock_advance(&rx->clock, rx->clock.period);
+		return;
+	}
+
+	unart_rx_calibrate_skew(rx);
+
+	// After a bad stop bit, wait for the line to go high before looking
+	// for the next start bit.
+	rx->poll_sampling = false;
+	rx->poll_level = bit;
+
+	rx->flush_pending = unart_rx_needs_idle_timeout(rx);
+	rx->poll_flush_time = rx->clock.time + unart_rx_frame_tail(rx) + rx->idle_timeout;
+}
+
+/**
+ * Reset the state machine before polling starts, and after it stops, so that
+ * neither polling nor the IRQ handler pick up a frame the other left
+ * unfinished.
+ */
+void unart_rx_poll_reset(struct unart_rx *rx)
+{
+	unart_rx_modbus_reset(rx);
+
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	rx->bit_index = -1;
+	rx->hunt_ticks = 0;
+	rx->irq_replay = false;
+	rx->flush_pending = false;
+	rx->poll_sampling = false;
+	rx->poll_level = 1;
+}
+
+/**
+ * Pass up to max characters from the FIFO on to the TTY layer. The data is
+ * only pushed through to readers once done is set, which is also the case if
+ * fewer than max characters were in the FIFO.
+ * Returns the number of characters.
+ */
+static size_t unart_rx_push_chunk(struct unart_rx *rx, size_t max, bool done)
+{
+	struct unart *unart = container_of(rx, struct unart, rx);
+
+	struct unart_rx_char chars[UNART_RX_PUSH_SIZE];
+	u8 buf[UNART_RX_PUSH_SIZE];
+	u8 tty_flags[UNART_RX_PUSH_SIZE];
+	unsigned long flags;
+
+	size_t n = kfifo_out(&rx->fifo, chars, min_t(size_t, max, ARRAY_SIZE(chars)));
+	done |= n < max;
+
+	// Flags are only passed on if there are any, which is rare.
+	bool any_flags = false;
+	for (size_t i = 0; i < n; ++i) {
+		buf[i] = chars[i].ch;
+		tty_flags[i] = chars[i].flag;
+		any_flags |= chars[i].flag != TTY_NORMAL;
+	}
+
+	// Bytes were lost after the ones that were in the FIFO at the time, so
+	// report that at the end.
+	bool overrun = false;
+	if (done) {
+		raw_spin_lock_irqsave(&rx->lock, flags);
+		overrun = rx->overrun;
+		rx->overrun = false;
+		raw_spin_unlock_irqrestore(&rx->lock, flags);
+	}
+
+	trace_unart_rx_push(unart->tty_index, n);
+	rx->push_callback(unart, buf, any_flags ? tty_flags : NULL, n, overrun, done);
+	return n;
+}
+
+/**
+ * Push each complete Modbus frame in one go.
+ */
+static void unart_rx_push_frames(struct unart_rx *rx)
+{
+	unsigned int len;
+	size_t n;
+
+	while (kfifo_get(&rx->frames, &len)) {
+		do {
+			size_t max = min_t(size_t, len, UNART_RX_PUSH_SIZE);
+			n = unart_rx_push_chunk(rx, max, len == max);
+			len -= n;
+		} while (len && n);
+	}
+}
+
+static void unart_rx_push_work(struct unart_work *push_work)
 {
 	struct unart_rx *rx = container_of(push_work, struct unart_rx, push_work);
+	size_t n;
+
+	if (rx->modbus) {
+		unart_rx_push_frames(rx);
+		return;
+	}
+
+	// Keep going until the FIFO is empty, including anything received in
+	// the meantime.
+	do {
+		n = unart_rx_push_chunk(rx, UNART_RX_PUSH_SIZE, false);
+	} while (n == UNART_RX_PUSH_SIZE);
+}
+
+
+/**
+ * Start detecting the baud rate. Called with the IRQ disabled.
+ */
+static void unart_rx_autobaud_start(struct unart_rx *rx)
+{
+	rx->autobaud_active = true;
+	rx->autobaud_edges = 0;
+	rx->autobaud_min = KTIME_MAX;
+	rx->autobaud_rate = 0;
+
+	// Detection needs both edges, but only the edge decoder gets them.
+	if (rx->mode == UNART_RX_MODE_SAMPLE)
+		irq_set_irq_type(rx->irq, IRQ_TYPE_EDGE_BOTH);
+}
+
+/**
+ * Stop detecting the baud rate. Called with the IRQ disabled.
+ */
+static void unart_rx_autobaud_stop(struct unart_rx *rx)
+{
+	if (!rx->autobaud_active)
+		return;
+
+	rx->autobaud_active = false;
+
+	if (rx->mode == UNART_RX_MODE_SAMPLE)
+		irq_set_irq_type(rx->irq, IRQ_TYPE_EDGE_FALLING);
+}
+
+static void unart_rx_autobaud_work(struct work_struct *autobaud_work)
+{
+	struct unart_rx *rx = container_of(autobaud_work, struct unart_rx, autobaud_work);
 	struct unart *unart = container_of(rx, struct unart, rx);
 
-	u8 buf[UNART_RX_FIFO_SIZE];
-	size_t n = kfifo_out(&rx->fifo, buf, sizeof(buf));
-	rx->push_callback(unart, buf, n);
+	disable_irq(rx->irq);
+	unart_rx_autobaud_stop(rx);
+	rx->autobaud_callback(unart, rx->autobaud_rate);
+	enable_irq(rx->irq);
 }
 
 
@@ -102,10 +994,16 @@ static void unart_rx_cleanup(void *_rx)
 {
 	struct unart_rx *rx = _rx;
 
-	disable_irq(rx->irq);
+	if (rx->mode == UNART_RX_MODE_BANK)
+		unart_bank_detach(rx);
+	else
+		disable_irq(rx->irq);
 	hrtimer_cancel(&rx->timer);
 	while (hrtimer_active(&rx->timer))
 		cond_resched();
+
+	cancel_work_sync(&rx->autobaud_work);
+	unart_cancel_work_sync(&rx->push_work);
 }
 
 int unart_rx_setup(struct platform_device *pdev, struct unart_rx *rx)
@@ -113,12 +1011,44 @@ int unart_rx_setup(struct platform_device *pdev, struct unart_rx *rx)
 	int err;
 
 	raw_spin_lock_init(&rx->lock);
-	INIT_WORK(&rx->push_work, unart_rx_push_work);
+	u64_stats_init(&rx->stats.irq_time.syncp);
+	u64_stats_init(&rx->stats.timer_time.syncp);
+	unart_work_init(&rx->push_work, unart_rx_push_work);
+	INIT_WORK(&rx->autobaud_work, unart_rx_autobaud_work);
+
+	INIT_KFIFO(rx->edges);
 
 	rx->bit_index = -1;
+	rx->hunt_ticks = 0;
+	rx->irq_masked = false;
+	rx->irq_replay = false;
+	rx->flush_pending = false;
+	rx->overrun = false;
+	rx->in_break = false;
+	rx->frame_len = 0;
+	rx->modbus_last_start = 0;
+	rx->level = 1;
+	rx->decoding = false;
 	rx->debug_toggle = 0;
+	rx->cpu = -1;
+	rx->autobaud_active = false;
+
+	rx->modbus = device_property_read_bool(&pdev->dev, "modbus-rtu") ||
+		     unart_params.modbus_rtu;
+
+	u32 fifo_size;
+	err = device_property_read_u32(&pdev->dev, "rx-fifo-size", &fifo_size);
+	if (err)
+		fifo_size = unart_params.rx_fifo_size;
+	fifo_size = min_t(u32, fifo_size, UNART_RX_FIFO_SIZE_MAX);
+
+	// Modbus frames are only pushed once complete, so the FIFO has to
+	// hold the largest possible one.
+	if (rx->modbus)
+		fifo_size = max_t(u32, fifo_size, UNART_MODBUS_FRAME_SIZE);
 
-	err = devm_kfifo_alloc(&pdev->dev, &rx->fifo, UNART_RX_FIFO_SIZE, GFP_KERNEL);
+	// Rounded up to a power of 2.
+	err = devm_kfifo_alloc(&pdev->dev, &rx->fifo, max(fifo_size, 2u), GFP_KERNEL);
 	if (err)
 		return err;
 
@@ -137,18 +1067,98 @@ int unart_rx_setup(struct platform_device *pdev, struct unart_rx *rx)
 		rx->skew_percent = unart_params.rx_skew;
 	rx->skew_percent = clamp(rx->skew_percent, 0u, 100u);
 
+	rx->skew_auto = device_property_read_bool(&pdev->dev, "rx-skew-auto") ||
+			unart_params.rx_skew_auto;
+	ewma_unart_latency_init(&rx->latency);
+
+	err = device_property_read_u32(&pdev->dev, "rx-vote-spacing", &rx->vote_spacing_config);
+	if (err)
+		rx->vote_spacing_config = unart_params.rx_vote_spacing;
+
+	if (rx->modbus) {
+		// At most one frame per byte in the FIFO.
+		err = devm_kfifo_alloc(&pdev->dev, &rx->frames, kfifo_size(&rx->fifo),
+				       GFP_KERNEL);
+		if (err)
+			return err;
+	}
+
+	u32 match_char;
+	err = device_property_read_u32(&pdev->dev, "rx-match-char", &match_char);
+	rx->match_char = err ? unart_params.rx_match_char : match_char;
+	if (rx->match_char < -1 || rx->match_char > 0xff) {
+		dev_err(&pdev->dev, "Invalid RX match character %d\n", rx->match_char);
+		return -EINVAL;
+	}
+
+	err = device_property_read_u32(&pdev->dev, "rx-threshold", &rx->threshold_config);
+	if (err)
+		rx->threshold_config = unart_params.rx_threshold;
+	unart_rx_update_threshold(rx);
+
+	err = device_property_read_u32(&pdev->dev, "rx-idle-timeout", &rx->idle_chars);
+	if (err)
+		rx->idle_chars = unart_params.rx_idle_timeout;
+	rx->idle_chars = max(rx->idle_chars, 1u);
+
+	err = device_property_read_u32(&pdev->dev, "rx-stream-bits", &rx->stream_bits);
+	if (err)
+		rx->stream_bits = unart_params.rx_stream_bits;
+	rx->stream_bits = min_t(u32, rx->stream_bits, UNART_RX_STREAM_BITS_MAX);
+
+	if (device_property_present(&pdev->dev, "rx-no-mask-irq"))
+		rx->mask_irq = false;
+	else
+		rx->mask_irq = unart_params.rx_mask_irq;
+
+	const char *mode;
+	err = device_property_read_string(&pdev->dev, "rx-mode", &mode);
+	if (err)
+		mode = unart_params.rx_mode;
+	err = match_string(unart_rx_mode_names, ARRAY_SIZE(unart_rx_mode_names), mode);
+	if (err < 0) {
+		dev_err(&pdev->dev, "Invalid RX mode \"%s\"\n", mode);
+		return -EINVAL;
+	}
+	rx->mode = err;
+
+	irq_handler_t irq_handler = unart_rx_irq_handler;
+	unsigned long irq_flags = IRQF_TRIGGER_FALLING;
+	enum hrtimer_restart (*timer_callback)(struct hrtimer *) = unart_rx_timer_callback;
+
+	if (rx->mode == UNART_RX_MODE_EDGE) {
+		irq_handler = unart_rx_edge_irq_handler;
+		irq_flags = IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+		timer_callback = unart_rx_edge_timer_callback;
+	}
+
+	hrtimer_setup(&rx->timer, timer_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+
+	rx->autobaud = device_property_read_bool(&pdev->dev, "autobaud") ||
+		       unart_params.autobaud;
+
+	// Sampling is done by the bank, there's no IRQ.
+	if (rx->mode == UNART_RX_MODE_BANK) {
+		if (rx->autobaud)
+			dev_warn(&pdev->dev, "Autobaud is not supported in bank mode\n");
+		rx->autobaud = false;
+		return devm_add_action_or_reset(&pdev->dev, unart_rx_cleanup, rx);
+	}
+
 	rx->irq = gpiod_to_irq(rx->gpio);
 	err = devm_request_irq(
-			&pdev->dev, rx->irq, unart_rx_irq_handler,
-			IRQF_TRIGGER_FALLING | IRQF_NO_THREAD | IRQF_NO_AUTOEN,
+			&pdev->dev, rx->irq, irq_handler,
+			irq_flags | IRQF_NO_THREAD | IRQF_NO_AUTOEN,
 			"unart-rx", rx);
 	if (err) {
 		dev_err(&pdev->dev, "Failed to request RX IRQ\n");
 		return err;
 	}
 
-	hrtimer_setup(&rx->timer, &unart_rx_timer_callback,
-		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	// Restored when the IRQ is no longer pinned to a CPU.
+	const struct cpumask *affinity = irq_get_affinity_mask(rx->irq);
+	cpumask_copy(&rx->irq_affinity, affinity ? affinity : cpu_possible_mask);
 
 	return devm_add_action_or_reset(&pdev->dev, unart_rx_cleanup, rx);
 }
@@ -156,17 +1166,120 @@ int unart_rx_setup(struct platform_device *pdev, struct unart_rx *rx)
 
 void unart_rx_set_baud_rate(struct unart_rx *rx, unsigned int baudrate)
 {
+	rx->baudrate = baudrate;
 	rx->period = ns_to_ktime(NSEC_PER_SEC / baudrate);
 	rx->skew = rx->period * rx->skew_percent / 100;
+	// Voting busy-waits with IRQs off, and all three samples have to fit
+	// well within the bit, and within a hunt tick.
+	rx->vote_spacing = min_t(u32, rx->vote_spacing_config, rx->period / 10);
+	unart_rx_calibrate_skew(rx);
+	unart_clock_set_baud_rate(&rx->clock, baudrate);
+	rx->hunt_tick = rx->period / UNART_RX_OVERSAMPLING;
+
+	if (rx->modbus) {
+		// Fixed times above 19200 baud, as the Modbus spec recommends.
+		rx->idle_timeout = baudrate > 19200 ? 1750 * NSEC_PER_USEC : rx->period * 35;
+		rx->modbus_t15 = baudrate > 19200 ? 750 * NSEC_PER_USEC : rx->period * 15;
+	} else {
+		// 10 bits per character.
+		rx->idle_timeout = rx->period * 10 * rx->idle_chars;
+	}
+	// The stop bit is sampled in its middle, count from the end of it.
+	rx->bank_idle_ticks = div64_s64(rx->idle_timeout, rx->hunt_tick) +
+			      UNART_RX_OVERSAMPLING / 2;
+
+	// Move to the bank for the new baud rate.
+	if (rx->bank) {
+		unart_bank_detach(rx);
+		if (unart_bank_attach(rx))
+			pr_warn("unart: Failed to rejoin RX bank\n");
+	}
+}
+
+/**
+ * Handle the RX IRQ and run the timer on the given CPU, or on any CPU if cpu
+ * is -1. The timer is started by the IRQ handler, and stays on its CPU.
+ */
+int unart_rx_set_cpu(struct unart_rx *rx, int cpu)
+{
+	WRITE_ONCE(rx->cpu, cpu);
+
+	// The bank has no IRQ, and its timer is shared.
+	if (rx->mode == UNART_RX_MODE_BANK)
+		return 0;
+
+	return irq_set_affinity(rx->irq, cpu >= 0 ? cpumask_of(cpu) : &rx->irq_affinity);
+}
+
+/**
+ * Enable or disable skew calibration. When disabled, the skew goes back to
+ * the configured percentage.
+ */
+void unart_rx_set_skew_auto(struct unart_rx *rx, bool skew_auto)
+{
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	rx->skew_auto = skew_auto;
+	if (skew_auto)
+		unart_rx_calibrate_skew(rx);
+	else
+		WRITE_ONCE(rx->skew, rx->period * rx->skew_percent / 100);
 }
 
 int unart_rx_activate(struct unart_rx *rx)
 {
+	unart_rx_modbus_reset(rx);
+
+	if (rx->mode == UNART_RX_MODE_BANK)
+		return unart_bank_attach(rx);
+
+	if (rx->mode == UNART_RX_MODE_EDGE)
+		unart_rx_edge_reset(rx);
+
+	if (rx->autobaud)
+		unart_rx_autobaud_start(rx);
+
 	enable_irq(rx->irq);
 	return 0;
 }
 
+/**
+ * Detect the baud rate each time the port is opened. Not supported in bank
+ * mode.
+ */
+int unart_rx_set_autobaud(struct unart_rx *rx, bool autobaud)
+{
+	if (autobaud && rx->mode == UNART_RX_MODE_BANK)
+		return -EOPNOTSUPP;
+
+	WRITE_ONCE(rx->autobaud, autobaud);
+	return 0;
+}
+
+/**
+ * Push received data as soon as the given character arrives, or only based on
+ * threshold and idle timeout if match_char is -1.
+ */
+int unart_rx_set_match_char(struct unart_rx *rx, int match_char)
+{
+	if (match_char < -1 || match_char > 0xff)
+		return -EINVAL;
+
+	raw_spin_lock_irqsave_scoped(&rx->lock);
+
+	rx->match_char = match_char;
+	unart_rx_update_threshold(rx);
+	return 0;
+}
+
 void unart_rx_shutdown(struct unart_rx *rx)
 {
+	if (rx->mode == UNART_RX_MODE_BANK) {
+		unart_bank_detach(rx);
+		return;
+	}
+
 	disable_irq(rx->irq);
+	cancel_work_sync(&rx->autobaud_work);
+	unart_rx_autobaud_stop(rx);
 }
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * unart - definitely not a real UART
+ * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
+ */
+#include "unart.h"
+#include "unart_util.h"
+
+#include <linux/bitmap.h>
+#include <linux/container_of.h>
+#include <linux/errno.h>
+#include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/*
+ * A tick group drives all TX instances with the same bit period from a
+ * single hrtimer. Each tick, every active member advances by one bit, and all
+ * TX lines are updated in one go.
+ */
+struct unart_tick_group {
+	struct list_head node;
+	ktime_t period;
+
+	struct hrtimer timer;
+	struct unart_clock clock;
+	bool running;
+
+	struct list_head members;
+	unsigned int member_count;
+
+	// Scratch space for gpiod_set_raw_array_value().
+	struct gpio_desc *descs[UNART_MAX_TTY_DEVICES];
+	DECLARE_BITMAP(values, UNART_MAX_TTY_DEVICES);
+
+	raw_spinlock_t lock;
+};
+
+static LIST_HEAD(tick_groups);
+static DEFINE_MUTEX(tick_groups_mutex);
+
+
+static enum hrtimer_restart unart_tick_timer_callback(struct hrtimer *timer)
+{
+	struct unart_tick_group *group =
+			container_of(timer, struct unart_tick_group, timer);
+	struct unart_tx *tx;
+	unsigned int count = 0;
+	bool active = false;
+
+	raw_spin_lock_irqsave_scoped(&group->lock);
+
+	list_for_each_entry(tx, &group->members, tick_node) {
+		int level;
+
+		if (!unart_tx_tick(tx, &level))
+			continue;
+
+		group->descs[count] = tx->gpio;
+		__assign_bit(count, group->values, level);
+		++count;
+
+		active |= tx->tick_active;
+	}
+
+	if (count)
+		gpiod_set_raw_array_value(count, group->descs, NULL, group->values);
+
+	if (!active) {
+		group->running = false;
+		return HRTIMER_NORESTART;
+	}
+
+	hrtimer_set_expires(timer, unart_clock_advance(&group->clock, group->clock.period));
+	return HRTIMER_RESTART;
+}
+
+
+/**
+ * Add a TX instance to the tick group for its current bit period, creating
+ * the group if necessary.
+ */
+int unart_tick_attach(struct unart_tx *tx)
+{
+	struct unart_tick_group *group;
+	unsigned long flags;
+
+	mutex_lock(&tick_groups_mutex);
+
+	list_for_each_entry(group, &tick_groups, node) {
+		if (group->period == tx->period)
+			goto found;
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group) {
+		mutex_unlock(&tick_groups_mutex);
+		return -ENOMEM;
+	}
+
+	group->period = tx->period;
+	group->clock.period = tx->clock.period;
+	INIT_LIST_HEAD(&group->members);
+	raw_spin_lock_init(&group->lock);
+	hrtimer_setup(&group->timer, &unart_tick_timer_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	list_add(&group->node, &tick_groups);
+
+found:
+	raw_spin_lock_irqsave(&group->lock, flags);
+	list_add_tail(&tx->tick_node, &group->members);
+	++group->member_count;
+	raw_spin_unlock_irqrestore(&group->lock, flags);
+
+	raw_spin_lock_irqsave(&tx->tick_lock, flags);
+	tx->tick_group = group;
+	raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+
+	mutex_unlock(&tick_groups_mutex);
+	return 0;
+}
+
+/**
+ * Remove a TX instance from its tick group. The group is destroyed once its
+ * last member is gone.
+ */
+void unart_tick_detach(struct unart_tx *tx)
+{
+	struct unart_tick_group *group = tx->tick_group;
+	unsigned long flags;
+
+	if (!group)
+		return;
+
+	mutex_lock(&tick_groups_mutex);
+
+	// No more writers after this.
+	raw_spin_lock_irqsave(&tx->tick_lock, flags);
+	tx->tick_group = NULL;
+	raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+
+	raw_spin_lock_irqsave(&group->lock, flags);
+	list_del(&tx->tick_node);
+	--group->member_count;
+	// Don't leave the line low in the middle of a frame, which would look
+	// like a break. The rest of the frame is lost.
+	if (tx->tick_active)
+		gpiod_set_raw_value(tx->gpio, 1);
+	tx->tick_active = false;
+	raw_spin_unlock_irqrestore(&group->lock, flags);
+
+	if (group->member_count == 0) {
+		hrtimer_cancel(&group->timer);
+		list_del(&group->node);
+		kfree(group);
+	}
+
+	mutex_unlock(&tick_groups_mutex);
+}
+
+/**
+ * Start sending data from the TX FIFO, if not already doing so. Called with
+ * tx->tick_lock held.
+ */
+void unart_tick_start(struct unart_tx *tx)
+{
+	struct unart_tick_group *group = tx->tick_group;
+
+	raw_spin_lock_irqsave_scoped(&group->lock);
+
+	if (unart_tx_tick_start(tx) && !group->running) {
+		group->running = true;
+		// Add one period so the first IRQ isn't automatically late.
+		unart_clock_reset(&group->clock, ktime_get() + group->period);
+		hrtimer_start(&group->timer, group->clock.time, HRTIMER_MODE_ABS_HARD);
+	}
+}
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * unart - definitely not a real UART
+ * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM unart
+
+#if !defined(_DSACRE_UNART_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DSACRE_UNART_TRACE_H
+
+#include "unart.h"
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+
+DECLARE_EVENT_CLASS(unart_port,
+	TP_PROTO(unsigned int port),
+	TP_ARGS(port),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+	),
+	TP_printk("port=%u", __entry->port)
+);
+
+DECLARE_EVENT_CLASS(unart_byte,
+	TP_PROTO(unsigned int port, u8 byte),
+	TP_ARGS(port, byte),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(u8, byte)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->byte = byte;
+	),
+	TP_printk("port=%u byte=0x%02x", __entry->port, __entry->byte)
+);
+
+DECLARE_EVENT_CLASS(unart_count,
+	TP_PROTO(unsigned int port, size_t count),
+	TP_ARGS(port, count),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(size_t, count)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->count = count;
+	),
+	TP_printk("port=%u count=%zu", __entry->port, __entry->count)
+);
+
+
+/*
+ * Falling edge of a start bit, detected by the IRQ handler or by sampling.
+ */
+DEFINE_EVENT(unart_port, unart_rx_start_edge,
+	TP_PROTO(unsigned int port),
+	TP_ARGS(port)
+);
+
+/*
+ * RX line sampled. Index -1 is the start bit, 8 is the stop bit.
+ */
+TRACE_EVENT(unart_rx_bit,
+	TP_PROTO(unsigned int port, int index, int level, s64 lateness_ns),
+	TP_ARGS(port, index, level, lateness_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(int, index)
+		__field(int, level)
+		__field(s64, lateness_ns)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->index = index;
+		__entry->level = level;
+		__entry->lateness_ns = lateness_ns;
+	),
+	TP_printk("port=%u index=%d level=%d lateness=%lldns",
+		  __entry->port, __entry->index, __entry->level,
+		  __entry->lateness_ns)
+);
+
+DEFINE_EVENT(unart_byte, unart_rx_frame,
+	TP_PROTO(unsigned int port, u8 byte),
+	TP_ARGS(port, byte)
+);
+
+TRACE_DEFINE_ENUM(UNART_RX_FALSE_START);
+TRACE_DEFINE_ENUM(UNART_RX_FRAME_ERROR);
+TRACE_DEFINE_ENUM(UNART_RX_BREAK);
+
+TRACE_EVENT(unart_rx_frame_error,
+	TP_PROTO(unsigned int port, enum unart_rx_error error),
+	TP_ARGS(port, error),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->error = error;
+	),
+	TP_printk("port=%u error=%s", __entry->port,
+		  __print_symbolic(__entry->error,
+				   { UNART_RX_FALSE_START, "false_start" },
+				   { UNART_RX_FRAME_ERROR, "frame_error" },
+				   { UNART_RX_BREAK, "break" }))
+);
+
+/*
+ * RX data handed over to the TTY layer.
+ */
+DEFINE_EVENT(unart_count, unart_rx_push,
+	TP_PROTO(unsigned int port, size_t count),
+	TP_ARGS(port, count)
+);
+
+DEFINE_EVENT(unart_byte, unart_tx_frame_start,
+	TP_PROTO(unsigned int port, u8 byte),
+	TP_ARGS(port, byte)
+);
+
+/*
+ * TX line set high for the last time in a frame, where it stays until the end
+ * of the stop bit. Driven by the tick group or polling thread, this is at the
+ * start of the stop bit itself.
+ */
+DEFINE_EVENT(unart_port, unart_tx_frame_end,
+	TP_PROTO(unsigned int port),
+	TP_ARGS(port)
+);
+
+/*
+ * Writers woken up, with the number of bytes left in the TX FIFO.
+ */
+DEFINE_EVENT(unart_count, unart_tx_wakeup,
+	TP_PROTO(unsigned int port, size_t count),
+	TP_ARGS(port, count)
+);
+
+#endif /* _DSACRE_UNART_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE unart_trace
+#include <trace/define_trace.h>
@@ -7,10 +7,19 @@
 
 #include <linux/bitmap.h>
 #include <linux/container_of.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/kobject.h>
+#include <linux/kstrtox.h>
+#include <linux/math64.h>
 #include <linux/mutex.h>
+#include <linux/numa.h>
 #include <linux/platform_device.h>
+#include <linux/pm_qos.h>
+#include <linux/property.h>
+#include <linux/serial.h>
+#include <linux/sysfs.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
@@ -92,6 +101,43 @@ static int unart_tty_tiocmset(struct tty_struct *tty, unsigned int set, unsigned
 	return 0;
 }
 
+static int unart_tty_get_icount(struct tty_struct *tty,
+				struct serial_icounter_struct *icount)
+{
+	struct unart *unart = tty->driver_data;
+
+	icount->rx = READ_ONCE(unart->rx.stats.bytes);
+	icount->tx = READ_ONCE(unart->tx.stats.bytes);
+	icount->frame = READ_ONCE(unart->rx.stats.frame_errors);
+	icount->overrun = READ_ONCE(unart->rx.stats.overruns);
+	icount->brk = READ_ONCE(unart->rx.stats.breaks);
+
+	return 0;
+}
+
+/**
+ * CPU wakeup latency that RX can tolerate. The start bit IRQ and the sampling
+ * timer may both be late, and together they must not push the sample point
+ * past the end of the bit.
+ */
+static s32 unart_tty_cpu_latency(struct unart *unart)
+{
+	if (unart->cpu_latency >= 0)
+		return unart->cpu_latency;
+
+	return ktime_to_us((unart->rx.period - unart->rx.skew) / 2);
+}
+
+static void unart_tty_set_baud_rate(struct unart *unart, unsigned int baud_rate)
+{
+	unart_rx_set_baud_rate(&unart->rx, baud_rate);
+	unart_tx_set_baud_rate(&unart->tx, baud_rate);
+
+	if (cpu_latency_qos_request_active(&unart->pm_qos))
+		cpu_latency_qos_update_request(&unart->pm_qos,
+					       unart_tty_cpu_latency(unart));
+}
+
 static void unart_tty_set_termios(struct tty_struct *tty, const struct ktermios *old)
 {
 	struct platform_device *pdev = to_platform_device(tty->dev->parent);
@@ -102,16 +148,44 @@ static void unart_tty_set_termios(struct tty_struct *tty, const struct ktermios
 
 	speed_t baud_rate = tty_get_baud_rate(tty);
 
-	unart_rx_set_baud_rate(&unart->rx, baud_rate);
-	unart_tx_set_baud_rate(&unart->tx, baud_rate);
+	unart_tty_set_baud_rate(unart, baud_rate);
 }
 
 
 static void unart_tty_rx_push_callback(
-		struct unart *unart, const u8 *buf, size_t count)
+		struct unart *unart, const u8 *buf, const u8 *flags, size_t count,
+		bool overrun, bool done)
 {
-	tty_insert_flip_string(&unart->tty_port, buf, count);
-	tty_flip_buffer_push(&unart->tty_port);
+	if (flags)
+		tty_insert_flip_string_flags(&unart->tty_port, buf, flags, count);
+	else
+		tty_insert_flip_string(&unart->tty_port, buf, count);
+	if (overrun)
+		tty_insert_flip_char(&unart->tty_port, 0, TTY_OVERRUN);
+	if (done)
+		tty_flip_buffer_push(&unart->tty_port);
+}
+
+static void unart_tty_rx_autobaud_callback(struct unart *unart, unsigned int baudrate)
+{
+	struct tty_struct *tty = tty_port_tty_get(&unart->tty_port);
+
+	dev_info(unart->tty_dev, "Detected %u baud\n", baudrate);
+
+	unart_tty_set_baud_rate(unart, baudrate);
+
+	// Make the new rate visible to user space.
+	if (tty) {
+		down_write(&tty->termios_rwsem);
+		tty_encode_baud_rate(tty, baudrate, baudrate);
+		up_write(&tty->termios_rwsem);
+		tty_kref_put(tty);
+	}
+
+	char event[32];
+	char *envp[] = { event, NULL };
+	snprintf(event, sizeof(event), "UNART_BAUD_RATE=%u", baudrate);
+	kobject_uevent_env(&unart->tty_dev->kobj, KOBJ_CHANGE, envp);
 }
 
 static void unart_tty_tx_wakeup_callback(struct unart *unart)
@@ -126,7 +200,17 @@ static int unart_tty_port_activate(struct tty_port *port, struct tty_struct *tty
 
 	tty->driver_data = unart;
 
-	unart_rx_activate(&unart->rx);
+	// The polling thread never lets its CPU go idle anyway.
+	if (unart->poll_cpu >= 0)
+		return unart_poll_attach(unart);
+
+	cpu_latency_qos_add_request(&unart->pm_qos, unart_tty_cpu_latency(unart));
+
+	int err = unart_rx_activate(&unart->rx);
+	if (err) {
+		cpu_latency_qos_remove_request(&unart->pm_qos);
+		return err;
+	}
 
 	return 0;
 }
@@ -135,7 +219,14 @@ static void unart_tty_port_shutdown(struct tty_port *port)
 {
 	struct unart *unart = container_of(port, struct unart, tty_port);
 
+	if (unart->poller) {
+		unart_poll_detach(unart);
+		return;
+	}
+
 	unart_rx_shutdown(&unart->rx);
+
+	cpu_latency_qos_remove_request(&unart->pm_qos);
 }
 
 
@@ -148,6 +239,7 @@ static const struct tty_operations unart_tty_ops = {
 	.wait_until_sent = unart_tty_wait_until_sent,
 	.tiocmget = unart_tty_tiocmget,
 	.tiocmset = unart_tty_tiocmset,
+	.get_icount = unart_tty_get_icount,
 	.set_termios = unart_tty_set_termios,
 };
 
@@ -162,12 +254,202 @@ static ssize_t name_show(struct device *dev, struct device_attribute *attr, char
 }
 static DEVICE_ATTR_RO(name);
 
+static ssize_t tx_low_watermark_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(unart->tx.low_watermark));
+}
+
+static ssize_t tx_low_watermark_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	unsigned int value;
+
+	int err = kstrtouint(buf, 0, &value);
+	if (err)
+		return err;
+
+	unart_tx_set_low_watermark(&unart->tx, value);
+	return count;
+}
+static DEVICE_ATTR_RW(tx_low_watermark);
+
+static ssize_t rx_skew_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	s64 skew = READ_ONCE(unart->rx.skew);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n",
+			 div_s64(skew * 100, ktime_to_ns(unart->rx.period)));
+}
+static DEVICE_ATTR_RO(rx_skew);
+
+static ssize_t rx_skew_auto_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(unart->rx.skew_auto));
+}
+
+static ssize_t rx_skew_auto_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	bool value;
+
+	int err = kstrtobool(buf, &value);
+	if (err)
+		return err;
+
+	unart_rx_set_skew_auto(&unart->rx, value);
+	return count;
+}
+static DEVICE_ATTR_RW(rx_skew_auto);
+
+static ssize_t rx_match_char_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(unart->rx.match_char));
+}
+
+static ssize_t rx_match_char_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	int value;
+
+	int err = kstrtoint(buf, 0, &value);
+	if (err)
+		return err;
+
+	err = unart_rx_set_match_char(&unart->rx, value);
+	if (err)
+		return err;
+	return count;
+}
+static DEVICE_ATTR_RW(rx_match_char);
+
+static ssize_t baud_rate_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(unart->rx.baudrate));
+}
+static DEVICE_ATTR_RO(baud_rate);
+
+static ssize_t autobaud_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(unart->rx.autobaud));
+}
+
+static ssize_t autobaud_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	bool value;
+
+	int err = kstrtobool(buf, &value);
+	if (err)
+		return err;
+
+	err = unart_rx_set_autobaud(&unart->rx, value);
+	if (err)
+		return err;
+
+	return count;
+}
+static DEVICE_ATTR_RW(autobaud);
+
+static ssize_t cpu_affinity_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(unart->tx.cpu));
+}
+
+static ssize_t cpu_affinity_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	int value;
+
+	int err = kstrtoint(buf, 0, &value);
+	if (err)
+		return err;
+	if (value < -1 || value >= (int)nr_cpu_ids)
+		return -EINVAL;
+
+	err = unart_rx_set_cpu(&unart->rx, value);
+	if (err)
+		return err;
+
+	unart_tx_set_cpu(&unart->tx, value);
+	return count;
+}
+static DEVICE_ATTR_RW(cpu_affinity);
+
+static ssize_t poll_cpu_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(unart->poll_cpu));
+}
+
+static ssize_t poll_cpu_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct unart *unart = dev_get_drvdata(dev);
+	int value;
+
+	int err = kstrtoint(buf, 0, &value);
+	if (err)
+		return err;
+	if (value < -1 || value >= (int)nr_cpu_ids)
+		return -EINVAL;
+
+	// Only takes effect the next time the port is opened, so don't
+	// pretend otherwise.
+	mutex_lock(&unart->tty_port.mutex);
+	if (tty_port_initialized(&unart->tty_port))
+		err = -EBUSY;
+	else
+		WRITE_ONCE(unart->poll_cpu, value);
+	mutex_unlock(&unart->tty_port.mutex);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(poll_cpu);
+
+static struct attribute *unart_tty_attrs[] = {
+	&dev_attr_name.attr,
+	&dev_attr_baud_rate.attr,
+	&dev_attr_autobaud.attr,
+	&dev_attr_rx_skew.attr,
+	&dev_attr_rx_skew_auto.attr,
+	&dev_attr_rx_match_char.attr,
+	&dev_attr_tx_low_watermark.attr,
+	&dev_attr_poll_cpu.attr,
+	&dev_attr_cpu_affinity.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(unart_tty);
+
 
 static void unart_tty_device_cleanup(void *_unart)
 {
 	struct unart *unart = _unart;
 
-	device_remove_file(unart->tty_dev, &dev_attr_name);
 	tty_port_unregister_device(&unart->tty_port, unart_tty_driver, unart->tty_index);
 	tty_port_destroy(&unart->tty_port);
 	release_device_index(unart->tty_index);
@@ -180,20 +462,39 @@ int unart_tty_device_setup(struct platform_device *pdev, struct unart *unart)
 		return index;
 	unart->tty_index = (unsigned int)index;
 
+	u32 cpu_latency;
+	if (device_property_read_u32(&pdev->dev, "cpu-latency-us", &cpu_latency) == 0)
+		unart->cpu_latency = cpu_latency;
+	else
+		unart->cpu_latency = unart_params.cpu_latency;
+
 	tty_port_init(&unart->tty_port);
 	unart->tty_port.ops = &unart_tty_port_ops;
 
-	unart->tty_dev = tty_port_register_device(&unart->tty_port,
-				unart_tty_driver, unart->tty_index, &pdev->dev);
+	unart->tty_dev = tty_port_register_device_attr(&unart->tty_port,
+				unart_tty_driver, unart->tty_index, &pdev->dev,
+				unart, unart_tty_groups);
 	if (IS_ERR(unart->tty_dev)) {
 		tty_port_destroy(&unart->tty_port);
 		release_device_index(unart->tty_index);
 		return PTR_ERR(unart->tty_dev);
 	}
 
-	device_create_file(unart->tty_dev, &dev_attr_name);
+	int cpu = -1;
+	u32 value;
+	if (device_property_read_u32(&pdev->dev, "cpu-affinity", &value) == 0)
+		cpu = value;
+	else if (unart_params.cpu_spread)
+		cpu = cpumask_local_spread(unart->tty_index, NUMA_NO_NODE);
+
+	if (cpu >= 0 && cpu < (int)nr_cpu_ids) {
+		if (unart_rx_set_cpu(&unart->rx, cpu))
+			dev_warn(&pdev->dev, "Failed to set RX IRQ affinity\n");
+		unart_tx_set_cpu(&unart->tx, cpu);
+	}
 
 	unart->rx.push_callback = unart_tty_rx_push_callback;
+	unart->rx.autobaud_callback = unart_tty_rx_autobaud_callback;
 	unart->tx.wakeup_callback = unart_tty_tx_wakeup_callback;
 
 	unart_rx_set_baud_rate(&unart->rx, unart_tty_driver->init_termios.c_ispeed);
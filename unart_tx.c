@@ -4,56 +4,314 @@
  * Copyright (c) 2025 Dominic Sacré <dominic@sacre.net>
  */
 #include "unart.h"
+#include "unart_trace.h"
 #include "unart_util.h"
 
+#include <linux/bits.h>
 #include <linux/container_of.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/gpio/consumer.h>
 #include <linux/hrtimer.h>
+#include <linux/irq_work.h>
 #include <linux/kfifo.h>
 #include <linux/ktime.h>
+#include <linux/minmax.h>
 #include <linux/platform_device.h>
+#include <linux/printk.h>
+#include <linux/property.h>
+#include <linux/smp.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 
 
-static enum hrtimer_restart unart_tx_timer_callback(struct hrtimer *timer)
+/**
+ * Load the next byte from the FIFO as a complete frame: start bit, 8 data bits
+ * (LSB first), stop bit.
+ */
+static bool unart_tx_next_frame(struct unart_tx *tx)
 {
-	struct unart_tx *tx = container_of(timer, struct unart_tx, timer);
+	u8 payload;
 
-	raw_spin_lock_irqsave_scoped(&tx->lock);
+	if (!kfifo_get(&tx->fifo, &payload))
+		return false;
+
+	tx->frame = BIT(9) | (payload << 1);
+	tx->bit_index = 0;
+	++tx->stats.bytes;
+	trace_unart_tx_frame_start(unart_tx_port(tx), payload);
 
-	if (tx->bit_index == -1) {
-		gpiod_set_raw_value(tx->gpio, 0); // Start bit
-		tx->bit_index = 0;
+	// Wake up writers early so the FIFO can be refilled before it runs
+	// dry.
+	if (kfifo_len(&tx->fifo) == tx->low_watermark)
+		unart_queue_work(&tx->wakeup_work);
 
-	} else if (tx->bit_index < 8) {
-		gpiod_set_raw_value(tx->gpio, tx->payload & 0b1);
-		tx->payload >>= 1;
+	return true;
+}
+
+/**
+ * Set the TX line for the current bit, and move on to the next level
+ * transition.
+ * Returns false if there's nothing left to send.
+ */
+static bool unart_tx_shift(struct unart_tx *tx)
+{
+	int level = (tx->frame >> tx->bit_index) & 1;
+	gpiod_set_raw_value(tx->gpio, level);
+
+	// Skip all following bits with the same level, the line doesn't need
+	// to be touched for those.
+	do {
 		++tx->bit_index;
+	} while (tx->bit_index < 10 && ((tx->frame >> tx->bit_index) & 1) == level);
+
+	if (tx->bit_index == 10) {
+		trace_unart_tx_frame_end(unart_tx_port(tx));
 
-	} else {
-		gpiod_set_raw_value(tx->gpio, 1); // Stop bit
-		tx->bit_index = -1;
+		// The line is high until the end of the stop bit. The next
+		// frame starts with a transition to low, if there is one.
+		unart_clock_advance(&tx->clock, tx->clock.period * 10);
 
 		// Get next data byte from FIFO. Wake up waiting tasks and
 		// stop timer if FIFO is empty.
-		if (!kfifo_get(&tx->fifo, &tx->payload)) {
-			schedule_work(&tx->wakeup_work);
-			return HRTIMER_NORESTART;
+		if (!unart_tx_next_frame(tx)) {
+			unart_queue_work(&tx->wakeup_work);
+			return false;
 		}
 	}
 
-	hrtimer_forward_now(timer, tx->period);
+	return true;
+}
+
+static enum hrtimer_restart unart_tx_timer_callback(struct hrtimer *timer)
+{
+	struct unart_tx *tx = container_of(timer, struct unart_tx, timer);
+
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+	unart_cpu_time_scoped(&tx->stats.timer_time);
+
+	++tx->stats.timer_callbacks;
+	unart_histogram_add_lateness(&tx->stats.timer_lateness, timer);
+
+	ktime_t spin_until = ktime_get() + tx->spin_budget;
+	ktime_t next;
+
+	for (;;) {
+		if (!unart_tx_shift(tx))
+			return HRTIMER_NORESTART;
+
+		next = unart_clock_peek(&tx->clock, tx->clock.period * tx->bit_index);
+
+		// Busy-wait for the next transition if that's cheaper than
+		// another round trip through the timer, as long as the spin
+		// budget allows. IRQs are off the whole time.
+		if (next > spin_until)
+			break;
+
+		while (ktime_get() < next)
+			cpu_relax();
+	}
+
+	hrtimer_set_expires(timer, next);
 	return HRTIMER_RESTART;
 }
 
-static void unart_tx_wakeup_work(struct work_struct *wakeup_work)
+
+static void unart_tx_start_work(struct irq_work *start_work)
+{
+	struct unart_tx *tx = container_of(start_work, struct unart_tx, start_work);
+
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+
+	tx->start_pending = false;
+	hrtimer_start(&tx->timer, tx->clock.time, HRTIMER_MODE_ABS_PINNED_HARD);
+}
+
+/**
+ * Start the timer, on the CPU TX is pinned to if any. A timer can only be
+ * pinned to the CPU it's started on, so this may have to be deferred to that
+ * CPU. Called with the lock held.
+ */
+static void unart_tx_start_timer(struct unart_tx *tx)
+{
+	int cpu = READ_ONCE(tx->cpu);
+
+	if (cpu >= 0 && cpu != smp_processor_id() && cpu_online(cpu)) {
+		tx->start_pending = true;
+		irq_work_queue_on(&tx->start_work, cpu);
+		return;
+	}
+
+	hrtimer_start(&tx->timer, tx->clock.time, unart_hrtimer_mode(cpu));
+}
+
+/**
+ * Start the timer if it's idle and there's something to send. Must be called
+ * with tx->lock held.
+ */
+static void unart_tx_kick_timer(struct unart_tx *tx)
+{
+	if (!hrtimer_active(&tx->timer) && !tx->start_pending &&
+	    unart_tx_next_frame(tx)) {
+		// Add one period so the first IRQ isn't automatically late.
+		// Also make sure the stop bit of the previous frame has been
+		// sent in full.
+		ktime_t target = ktime_get() + tx->period;
+		if (target > tx->clock.time)
+			unart_clock_reset(&tx->clock, target);
+		unart_tx_start_timer(tx);
+	}
+}
+
+/**
+ * Start sending the next frame when driven by a tick group or polling thread
+ * rather than tx->timer. Called with the group's lock held, if any.
+ * Returns true if there is a frame being sent.
+ */
+bool unart_tx_tick_start(struct unart_tx *tx)
+{
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+
+	if (!tx->tick_active && unart_tx_next_frame(tx))
+		tx->tick_active = true;
+
+	return tx->tick_active;
+}
+
+/**
+ * Advance by one bit period when driven by a tick group or polling thread.
+ * Called with the group's lock held, if any.
+ * Returns false if there's nothing to send, otherwise sets *level to the line
+ * level for this bit period.
+ */
+bool unart_tx_tick(struct unart_tx *tx, int *level)
+{
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+	unart_cpu_time_scoped(&tx->stats.timer_time);
+
+	if (!tx->tick_active)
+		return false;
+
+	*level = (tx->frame >> tx->bit_index) & 1;
+
+	if (++tx->bit_index < 10)
+		return true;
+
+	trace_unart_tx_frame_end(unart_tx_port(tx));
+
+	// Get next data byte from FIFO after the stop bit. Wake up waiting
+	// tasks and leave the group if FIFO is empty.
+	if (!unart_tx_next_frame(tx)) {
+		tx->tick_active = false;
+		unart_queue_work(&tx->wakeup_work);
+	}
+
+	return true;
+}
+
+/**
+ * Keep writers from starting the timer while moving between tick groups.
+ * Anything they write in the meantime is sent once the switch is complete.
+ */
+static void unart_tx_begin_switch(struct unart_tx *tx)
+{
+	raw_spin_lock_irqsave_scoped(&tx->tick_lock);
+	tx->tick_switching = true;
+}
+
+static void unart_tx_end_switch(struct unart_tx *tx)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&tx->tick_lock, flags);
+	tx->tick_switching = false;
+	if (tx->tick_group) {
+		unart_tick_start(tx);
+		raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+		return;
+	}
+	raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+	unart_tx_kick_timer(tx);
+}
+
+/**
+ * Drive the TX line from a polling thread, which calls this as often as it
+ * can. Uses the same state machine as the tick group, with the clock
+ * advancing by one bit period per tick.
+ */
+void unart_tx_poll(struct unart_tx *tx, ktime_t now)
+{
+	int level;
+
+	if (!READ_ONCE(tx->tick_active)) {
+		if (kfifo_is_empty(&tx->fifo) || !unart_tx_tick_start(tx))
+			return;
+
+		// Make sure the stop bit of the previous frame has been sent
+		// in full.
+		if (now > tx->clock.time)
+			unart_clock_reset(&tx->clock, now);
+	}
+
+	if (now < tx->clock.time)
+		return;
+
+	unart_histogram_add(&tx->stats.timer_lateness, now - tx->clock.time);
+
+	if (unart_tx_tick(tx, &level))
+		gpiod_set_raw_value(tx->gpio, level);
+
+	unart_clock_advance(&tx->clock, tx->clock.period);
+}
+
+/**
+ * Hand TX over to a polling thread, or back to the timer or tick group.
+ * Any frame currently being sent is cut short, and the line is returned to
+ * idle.
+ */
+void unart_tx_set_polled(struct unart_tx *tx, bool polled)
+{
+	bool join = !polled && tx->shared_clock;
+	unsigned long flags;
+
+	if (join)
+		unart_tx_begin_switch(tx);
+
+	raw_spin_lock_irqsave(&tx->lock, flags);
+	tx->polled = polled;
+	raw_spin_unlock_irqrestore(&tx->lock, flags);
+
+	if (polled) {
+		unart_tick_detach(tx);
+		irq_work_sync(&tx->start_work);
+		hrtimer_cancel(&tx->timer);
+	}
+
+	raw_spin_lock_irqsave(&tx->lock, flags);
+	tx->tick_active = false;
+	// Don't leave the line low in the middle of a frame, which would look
+	// like a break.
+	gpiod_set_raw_value(tx->gpio, 1);
+	raw_spin_unlock_irqrestore(&tx->lock, flags);
+
+	if (!join)
+		return;
+
+	if (unart_tick_attach(tx))
+		dev_warn(tx->dev, "Failed to join tick group, using separate timer\n");
+	unart_tx_end_switch(tx);
+}
+
+static void unart_tx_wakeup_work(struct unart_work *wakeup_work)
 {
 	struct unart_tx *tx = container_of(wakeup_work, struct unart_tx, wakeup_work);
 	struct unart *unart = container_of(tx, struct unart, tx);
 
+	trace_unart_tx_wakeup(unart->tty_index, kfifo_len(&tx->fifo));
+
 	wake_up_interruptible(&tx->wait_queue);
 	tx->wakeup_callback(unart);
 }
@@ -63,17 +321,30 @@ static void unart_tx_cleanup(void *_tx)
 {
 	struct unart_tx *tx = _tx;
 
+	unart_tick_detach(tx);
+
+	irq_work_sync(&tx->start_work);
 	hrtimer_cancel(&tx->timer);
 	wait_event_interruptible(tx->wait_queue, !hrtimer_active(&tx->timer));
+
+	unart_cancel_work_sync(&tx->wakeup_work);
 }
 
 int unart_tx_setup(struct platform_device *pdev, struct unart_tx *tx)
 {
 	int err;
 
+	tx->dev = &pdev->dev;
 	raw_spin_lock_init(&tx->lock);
+	raw_spin_lock_init(&tx->tick_lock);
+	tx->tick_switching = false;
+	u64_stats_init(&tx->stats.timer_time.syncp);
+	unart_clock_reset(&tx->clock, 0);
 	init_waitqueue_head(&tx->wait_queue);
-	INIT_WORK(&tx->wakeup_work, unart_tx_wakeup_work);
+	unart_work_init(&tx->wakeup_work, unart_tx_wakeup_work);
+	tx->start_work = IRQ_WORK_INIT_HARD(unart_tx_start_work);
+	tx->start_pending = false;
+	tx->cpu = -1;
 
 	err = devm_kfifo_alloc(&pdev->dev, &tx->fifo, UNART_TX_FIFO_SIZE, GFP_KERNEL);
 	if (err)
@@ -89,6 +360,23 @@ int unart_tx_setup(struct platform_device *pdev, struct unart_tx *tx)
 		return -EINVAL;
 	}
 
+	u32 low_watermark;
+	err = device_property_read_u32(&pdev->dev, "tx-low-watermark", &low_watermark);
+	if (err)
+		low_watermark = unart_params.tx_low_watermark;
+	unart_tx_set_low_watermark(tx, low_watermark);
+
+	u32 spin_budget;
+	err = device_property_read_u32(&pdev->dev, "tx-spin-budget", &spin_budget);
+	if (err)
+		spin_budget = unart_params.tx_spin_budget;
+	// IRQs are off while spinning.
+	spin_budget = min_t(u32, spin_budget, UNART_TX_SPIN_BUDGET_MAX);
+	tx->spin_budget = (ktime_t)spin_budget * NSEC_PER_USEC;
+
+	tx->shared_clock = device_property_read_bool(&pdev->dev, "tx-shared-clock") ||
+			   unart_params.tx_shared_clock;
+
 	hrtimer_setup(&tx->timer, &unart_tx_timer_callback,
 		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
 
@@ -98,25 +386,70 @@ int unart_tx_setup(struct platform_device *pdev, struct unart_tx *tx)
 
 void unart_tx_set_baud_rate(struct unart_tx *tx, unsigned int baudrate)
 {
-	tx->period = ns_to_ktime(NSEC_PER_SEC / baudrate);
+	ktime_t period = ns_to_ktime(NSEC_PER_SEC / baudrate);
+
+	unart_clock_set_baud_rate(&tx->clock, baudrate);
+
+	if (!tx->shared_clock || tx->polled) {
+		tx->period = period;
+		return;
+	}
+
+	if (tx->tick_group && period == tx->period)
+		return;
+
+	// Move to the tick group for the new baud rate, and resume sending
+	// if there's anything left in the FIFO.
+	unart_tx_begin_switch(tx);
+	unart_tick_detach(tx);
+	// The separate timer may be running if joining a group failed before.
+	// Cut any frame it's sending short, leaving the line idle.
+	irq_work_sync(&tx->start_work);
+	if (hrtimer_cancel(&tx->timer)) {
+		raw_spin_lock_irqsave_scoped(&tx->lock);
+		gpiod_set_raw_value(tx->gpio, 1);
+	}
+	tx->period = period;
+
+	if (unart_tick_attach(tx))
+		dev_warn(tx->dev, "Failed to join tick group, using separate timer\n");
+	unart_tx_end_switch(tx);
+}
+
+/**
+ * Run the timer on the given CPU, or on any CPU if cpu is -1. Takes effect
+ * the next time the timer is started.
+ */
+void unart_tx_set_cpu(struct unart_tx *tx, int cpu)
+{
+	WRITE_ONCE(tx->cpu, cpu);
 }
 
 ssize_t unart_tx_write(struct unart_tx *tx, const u8 *buf, size_t count)
 {
+	unsigned long flags;
+
 	// Disable TX entirely if RX debugging is enabled.
 	if (unart_params.rx_debug)
 		return count;
 
 	ssize_t ret = kfifo_in(&tx->fifo, buf, count);
 
-	raw_spin_lock_irqsave_scoped(&tx->lock);
+	// The polling thread picks it up from here.
+	if (READ_ONCE(tx->polled))
+		return ret;
 
-	if (!hrtimer_active(&tx->timer) && kfifo_get(&tx->fifo, &tx->payload)) {
-		tx->bit_index = -1;
-		// Add one period so the first IRQ isn't automatically late.
-		ktime_t target = ktime_get() + tx->period;
-		hrtimer_start(&tx->timer, target, HRTIMER_MODE_ABS_HARD);
+	raw_spin_lock_irqsave(&tx->tick_lock, flags);
+	if (tx->tick_group || tx->tick_switching) {
+		if (tx->tick_group)
+			unart_tick_start(tx);
+		raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+		return ret;
 	}
+	raw_spin_unlock_irqrestore(&tx->tick_lock, flags);
+
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+	unart_tx_kick_timer(tx);
 
 	return ret;
 }
@@ -127,6 +460,12 @@ size_t unart_tx_write_room(struct unart_tx *tx)
 	return kfifo_avail(&tx->fifo);
 }
 
+void unart_tx_set_low_watermark(struct unart_tx *tx, unsigned int low_watermark)
+{
+	raw_spin_lock_irqsave_scoped(&tx->lock);
+	tx->low_watermark = min(low_watermark, kfifo_size(&tx->fifo) - 1);
+}
+
 void unart_tx_wait_until_sent(struct unart_tx *tx, int timeout)
 {
 	wait_event_interruptible_timeout(
@@ -6,11 +6,24 @@
 #ifndef _DSACRE_UNART_UTIL_H
 #define _DSACRE_UNART_UTIL_H
 
+#include "unart.h"
+
 #include <linux/device.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
 #include <linux/hrtimer.h>
+#include <linux/jump_label.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/sched/clock.h>
 #include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 /*
  * Scope-based wrapper around raw_spin_lock_irqsave().
@@ -33,22 +46,20 @@ static inline void raw_spin_unlock_irqrestore_scoped(
 
 
 /*
- * Devres wrapper around kfifo_alloc().
+ * Devres wrapper around kfifo_alloc(), for any element type.
  */
-static void devm_kfifo_free(void *data)
+static inline void devm_kfifo_free(void *data)
 {
-	kfifo_free((struct kfifo *)data);
+	__kfifo_free((struct __kfifo *)data);
 }
 
-static inline int devm_kfifo_alloc(struct device *dev, struct kfifo *fifo,
-				   unsigned int size, gfp_t gfp_mask)
-{
-	int err = kfifo_alloc(fifo, size, gfp_mask);
-	if (err)
-		return err;
-
-	return devm_add_action_or_reset(dev, devm_kfifo_free, fifo);
-}
+#define devm_kfifo_alloc(dev, fifo, size, gfp_mask) \
+({ \
+	int __err = kfifo_alloc(fifo, size, gfp_mask); \
+	if (!__err) \
+		__err = devm_add_action_or_reset(dev, devm_kfifo_free, &(fifo)->kfifo); \
+	__err; \
+})
 
 /*
  * kfifo_is_empty_spinlocked(), but with a raw spinlock.
@@ -76,4 +87,172 @@ static inline void hrtimer_setup(struct hrtimer *timer,
 }
 #endif
 
+
+/*
+ * Helpers for struct unart_work.
+ */
+static inline void unart_work_fn(struct work_struct *work)
+{
+	struct unart_work *w = container_of(work, struct unart_work, work);
+	w->func(w);
+}
+
+static inline void unart_kwork_fn(struct kthread_work *kwork)
+{
+	struct unart_work *w = container_of(kwork, struct unart_work, kwork);
+	w->func(w);
+}
+
+static inline void unart_work_init(struct unart_work *w,
+				   void (*func)(struct unart_work *work))
+{
+	INIT_WORK(&w->work, unart_work_fn);
+	kthread_init_work(&w->kwork, unart_kwork_fn);
+	w->func = func;
+}
+
+static inline bool unart_queue_work(struct unart_work *w)
+{
+	if (unart_worker)
+		return kthread_queue_work(unart_worker, &w->kwork);
+	return schedule_work(&w->work);
+}
+
+static inline void unart_cancel_work_sync(struct unart_work *w)
+{
+	cancel_work_sync(&w->work);
+	kthread_cancel_work_sync(&w->kwork);
+}
+
+
+/*
+ * hrtimer mode for starting a timer, pinned to the current CPU if the
+ * instance has a CPU affinity.
+ */
+static inline enum hrtimer_mode unart_hrtimer_mode(int cpu)
+{
+	return cpu >= 0 ? HRTIMER_MODE_ABS_PINNED_HARD : HRTIMER_MODE_ABS_HARD;
+}
+
+
+/*
+ * Add a time delta to a histogram, if histograms are enabled.
+ */
+static inline void unart_histogram_add(struct unart_histogram *hist, s64 delta_ns)
+{
+	if (!static_branch_unlikely(&unart_histograms_enabled))
+		return;
+
+	unsigned int bucket = delta_ns > 0 ? ilog2((u64)delta_ns) + 1 : 0;
+	++hist->buckets[min_t(unsigned int, bucket, UNART_HISTOGRAM_BUCKETS - 1)];
+}
+
+/*
+ * Add the lateness of a running timer callback to a histogram.
+ */
+static inline void unart_histogram_add_lateness(struct unart_histogram *hist,
+						struct hrtimer *timer)
+{
+	if (!static_branch_unlikely(&unart_histograms_enabled))
+		return;
+
+	unart_histogram_add(hist, ktime_get() - hrtimer_get_expires(timer));
+}
+
+/*
+ * Scope-based CPU time accounting. Adds the time until the end of the
+ * enclosing scope to a struct unart_cpu_time, if accounting is enabled.
+ * Declare it after taking the lock that serializes updates, so that the update
+ * happens before the lock is released.
+ */
+struct unart_cpu_time_scope {
+	struct unart_cpu_time *time;
+	u64 start;
+};
+
+static inline u64 unart_cpu_time_start(void)
+{
+	if (!static_branch_unlikely(&unart_cpu_accounting_enabled))
+		return 0;
+
+	return local_clock();
+}
+
+static inline void unart_cpu_time_end(struct unart_cpu_time_scope *scope)
+{
+	if (!scope->start)
+		return;
+
+	u64 delta = local_clock() - scope->start;
+
+	u64_stats_update_begin(&scope->time->syncp);
+	scope->time->total_ns += delta;
+	scope->time->max_ns = max(scope->time->max_ns, delta);
+	++scope->time->count;
+	u64_stats_update_end(&scope->time->syncp);
+}
+
+#define unart_cpu_time_scoped(_time) \
+	__attribute__((__cleanup__(unart_cpu_time_end))) \
+		struct unart_cpu_time_scope __cpu_time_scope = { \
+			.time = (_time), .start = unart_cpu_time_start() }
+
+/*
+ * Fixed-point bit clock, see struct unart_clock.
+ */
+static inline void unart_clock_set_baud_rate(struct unart_clock *clock,
+					     unsigned int baudrate)
+{
+	clock->period = div_u64((u64)NSEC_PER_SEC << 32, baudrate);
+}
+
+static inline void unart_clock_reset(struct unart_clock *clock, ktime_t time)
+{
+	clock->time = time;
+	clock->frac = 0;
+}
+
+/*
+ * Convert a fixed-point duration to nanoseconds.
+ */
+static inline ktime_t unart_clock_ns(u64 delta)
+{
+	return delta >> 32;
+}
+
+/*
+ * Return the deadline a fixed-point duration after the current one, without
+ * advancing the clock.
+ */
+static inline ktime_t unart_clock_peek(const struct unart_clock *clock, u64 delta)
+{
+	return clock->time + unart_clock_ns(delta + clock->frac);
+}
+
+/*
+ * Advance the clock by a fixed-point duration, and return the new deadline.
+ */
+static inline ktime_t unart_clock_advance(struct unart_clock *clock, u64 delta)
+{
+	delta += clock->frac;
+	clock->time += unart_clock_ns(delta);
+	clock->frac = (u32)delta;
+	return clock->time;
+}
+
+/*
+ * Identify the GPIO controller a descriptor belongs to.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+static inline const void *unart_gpiod_controller(struct gpio_desc *desc)
+{
+	return gpiod_to_chip(desc);
+}
+#else
+static inline const void *unart_gpiod_controller(struct gpio_desc *desc)
+{
+	return gpiod_to_gpio_device(desc);
+}
+#endif
+
 #endif /* _DSACRE_UNART_UTIL_H */